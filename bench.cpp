@@ -0,0 +1,202 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include "crypto.hpp"
+#include "utils.hpp"
+#include "hashmap.hpp"
+#include "argparse.hpp"
+#include "party.hpp"
+
+using namespace std;
+
+/*
+  Per-kernel microbenchmarks. Every kernel runs warmup untimed calls, then
+  reps timed calls; each call processes ops units (hashes, plaintexts,
+  ciphertexts, ...) and throughput is ops over the median call time.
+*/
+struct BenchResult
+{
+  string name, unit;
+  size_t ops, reps;
+  double min, mean, p50, p90, p99, max;
+};
+
+struct Bench
+{
+  size_t warmup, reps;
+  string filter;
+  vector<BenchResult> results;
+
+  template <typename F>
+  void run(const string &name, const string &unit, size_t ops, F &&f)
+  {
+    if (!filter.empty() && name.find(filter) == string::npos)
+      return;
+    for (size_t i = 0; i < warmup; i++)
+      f();
+
+    vector<double> t(reps);
+    for (size_t i = 0; i < reps; i++)
+    {
+      uint64_t t0 = Tracer::now();
+      f();
+      t[i] = (double)(Tracer::now() - t0) / 1e9;
+    }
+    sort(t.begin(), t.end());
+    auto pct = [&t](double p)
+    { return t[min((size_t)(p * (double)t.size()), t.size() - 1)]; };
+    double sum = 0;
+    for (double x : t)
+      sum += x;
+
+    BenchResult r = {name, unit, ops, reps, t.front(), sum / (double)reps, pct(0.5), pct(0.9), pct(0.99), t.back()};
+    printf("%-28s %10.3f %10.3f %10.3f %10.3f %14.1f %s/s\n", name.c_str(), r.p50 * 1e3, r.p90 * 1e3, r.p99 * 1e3, r.mean * 1e3, (double)ops / r.p50, unit.c_str());
+    results.push_back(r);
+  }
+
+  void write_csv(const string &path)
+  {
+    ofstream out(path);
+    out << "kernel,unit,ops_per_call,reps,min_s,mean_s,p50_s,p90_s,p99_s,max_s,ops_per_s" << endl;
+    for (auto &r : results)
+      out << r.name << "," << r.unit << "," << r.ops << "," << r.reps << "," << r.min << "," << r.mean << "," << r.p50 << "," << r.p90 << "," << r.p99 << "," << r.max << "," << (double)r.ops / r.p50 << endl;
+  }
+};
+
+int main(int argc, char *argv[])
+{
+  argparse::ArgumentParser program("pqmpso kernel benchmarks");
+
+  program.add_argument("--reps")
+      .default_value(50)
+      .help("timed calls per kernel")
+      .scan<'i', int>();
+
+  program.add_argument("--warmup")
+      .default_value(5)
+      .help("untimed calls per kernel before timing")
+      .scan<'i', int>();
+
+  program.add_argument("--filter")
+      .help("only run kernels whose name contains this")
+      .default_value(string(""));
+
+  program.add_argument("--csv")
+      .help("also write the results to this CSV file")
+      .default_value(string(""));
+
+  program.add_argument("--tag")
+      .help("tag length in bytes")
+      .default_value(48)
+      .scan<'i', int>();
+
+  program.add_argument("--pt-bits")
+      .help("tag bits per BFV coefficient")
+      .default_value(16)
+      .scan<'i', int>();
+
+  program.add_argument("--cache")
+      .help("directory to keep crypto contexts in across runs")
+      .default_value(string(""));
+
+  try
+  {
+    program.parse_args(argc, argv);
+  }
+  catch (const runtime_error &err)
+  {
+    cerr << err.what() << endl;
+    cerr << program;
+    exit(1);
+  }
+
+  Bench bench = {(size_t)program.get<int>("--warmup"), (size_t)max(program.get<int>("--reps"), 1), program.get<string>("--filter"), {}};
+  auto csv = program.get<string>("--csv");
+
+  // The protocol's defaults: compact packing, one thread
+  size_t ring_dim = 32768, hash_sz = (size_t)program.get<int>("--tag"), set_sz = 1 << 12;
+  uint64_t bfv_mod = bfv_plain_modulus(ring_dim, (size_t)program.get<int>("--pt-bits"));
+  size_t batch_size = n_hashes_in_pt(MULTIPLE_COMPACT, ring_dim, plain_mod_bits(bfv_mod), hash_sz * 8);
+  size_t num_cf_per_hash = ring_dim / batch_size;
+  size_t nbits = hash_sz * 8;
+  size_t batch_bitwise = ring_dim / nbits;
+
+  set_ctx_cache_dir(program.get<string>("--cache"));
+  shared_ptr<CCParams<CryptoContextBFVRNS>> bfv_parms = gen_bfv_params(ring_dim, 1, bfv_mod);
+  shared_ptr<CCParams<CryptoContextCKKSRNS>> ckks_parms = gen_ckks_params(ring_dim);
+  CryptoContext<DCRTPoly> bfv_ctx = cached_crypto_ctx(bfv_parms);
+  CryptoContext<DCRTPoly> ckks_ctx = cached_crypto_ctx(ckks_parms);
+  KeyPair<DCRTPoly> kp = bfv_ctx->KeyGen();
+  size_t plain_mod = bfv_ctx->GetCryptoParameters()->GetPlaintextModulus();
+
+  ProtocolParameters pro_parms = {0, 2, set_sz * 4, hash_sz, 1, batch_size, false, MULTIPLE_COMPACT, nullptr, nullptr};
+  // Every HashMap below shares this pool, so no timed call starts threads
+  ensure_pool(pro_parms);
+  HashMap hm_probe(pro_parms);
+  Sha3Hasher hasher;
+  vector<uint8_t> digest(hm_probe.slot_hash_len());
+  vector<string> X = random_strings(set_sz);
+  vector<uint8_t> hashes(batch_size * hash_sz);
+  random_bytes(hashes.data(), hashes.size());
+  vector<int64_t> int_vec(ring_dim);
+  random_ints(int_vec, plain_mod);
+
+  PT pt = bfv_ctx->MakePackedPlaintext(int_vec), pt_out;
+  CT ct = bfv_ctx->Encrypt(kp.publicKey, pt), ct_out;
+  ZeroBitmap matches(1, batch_size);
+  vector<vector<uint8_t>> unpacked;
+  size_t next = 0;
+
+  print_title("Kernels");
+  printf("%-28s %10s %10s %10s %10s %14s\n", "kernel", "p50 ms", "p90 ms", "p99 ms", "mean ms", "throughput");
+
+  bench.run("slot_hash", "hash", 1, [&hm_probe, &hasher, &digest, &X, &next]()
+            { hm_probe.slot_hash(hasher, X[next++ % X.size()], digest.data()); });
+
+  bench.run("sha384", "hash", 1, [&X, &next]()
+            { sha384(X[next++ % X.size()]); });
+
+  bench.run("HashMap::insert", "elem", set_sz, [&pro_parms, &X]()
+            {
+              HashMap hm(pro_parms);
+              hm.insert(X); });
+
+  bench.run("pack_multiple_compact", "hash", batch_size, [&]()
+            { pack_multiple_compact(bfv_ctx, &pt_out, hashes.data(), hash_sz, batch_size, num_cf_per_hash, ring_dim, true, &int_vec); });
+
+  bench.run("pack_bitwise_multiple", "hash", batch_bitwise, [&]()
+            { pack_bitwise_multiple(bfv_ctx, &pt_out, hashes.data(), batch_bitwise, nbits, true, &int_vec); });
+
+  bench.run("unpack_multiple_compact", "pt", 1, [&pt, &unpacked, hash_sz, num_cf_per_hash]()
+            { unpack_multiple_compact(pt, &unpacked, hash_sz, num_cf_per_hash); });
+
+  bench.run("random_int", "int", 1024, [plain_mod, &int_vec]()
+            {
+              for (size_t i = 0; i < 1024; i++)
+                int_vec[i] = random_int(plain_mod); });
+
+  bench.run("MakePackedPlaintext", "pt", 1, [&bfv_ctx, &int_vec, &pt_out]()
+            { pt_out = bfv_ctx->MakePackedPlaintext(int_vec); });
+
+  bench.run("encrypt_single", "ct", 1, [&bfv_ctx, &kp, &pt, &ct_out]()
+            { encrypt_single(bfv_ctx, kp.publicKey, &pt, &ct_out); });
+
+  bench.run("subtract_single", "ct", 1, [&bfv_ctx, &ct, &pt, &ct_out]()
+            { subtract_single(bfv_ctx, &ct, &pt, &ct_out); });
+
+  bench.run("multiply_single", "ct", 1, [&bfv_ctx, &ct, &pt, &ct_out]()
+            { multiply_single(bfv_ctx, &ct, &pt, &ct_out); });
+
+  bench.run("randomize_single_inplace", "ct", 1, [&]()
+            {
+              ct_out = ct;
+              randomize_single_inplace(bfv_ctx, ckks_ctx, &ct_out, nullptr, plain_mod, ring_dim, num_cf_per_hash); });
+
+  bench.run("decrypt_check_one", "ct", 1, [&]()
+            { decrypt_check_one(bfv_ctx, kp.secretKey, &ct, nbits, MULTIPLE_COMPACT, matches.row(0), batch_size); });
+
+  print_sep();
+  if (csv != "")
+    bench.write_csv(csv);
+  return 0;
+}
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <mutex>
+#include <sstream>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
@@ -9,9 +14,11 @@
 #include "cryptocontext-ser.h"
 #include "key/key-ser.h"
 #include "scheme/bfvrns/bfvrns-ser.h"
+#include "scheme/ckksrns/ckksrns-ser.h"
 
 #include "utils.hpp"
 #include "BS_thread_pool.hpp"
+#include "trace.hpp"
 
 using namespace std;
 using namespace lbcrypto;
@@ -38,8 +45,60 @@ struct ProtocolParameters
   PackingType pack_type;
   PK pk, apk;
   shared_ptr<EvalKeys> ek, ask;
+  // Cuckoo hashing: candidate slots per element (1 = plain hashing), tags per
+  // provider bin, and the public seed the delegate's table was built under
+  size_t num_hash_fns = 1, bin_sz = 1;
+  uint32_t hash_seed = 0;
+  // Ciphertexts whose plaintexts are built and freed together (0 = all at once)
+  size_t chunk_ct = 0;
+  // Sparse delegate map: M holds only the plaintexts with delegate elements,
+  // ct_pt[k] being the one behind ciphertext k; set by the delegate's start
+  bool sparse = false;
+  shared_ptr<const vector<size_t>> ct_pt;
+  // Worker pool shared by every phase and party in the process
+  shared_ptr<BS::thread_pool> pool;
 };
 
+// Creates pp's shared pool with num_threads workers if it has none yet
+inline BS::thread_pool &ensure_pool(ProtocolParameters &pp)
+{
+  if (pp.pool == nullptr)
+    pp.pool = make_shared<BS::thread_pool>(max(pp.num_threads, (size_t)1));
+  return *pp.pool;
+}
+
+/*
+  Runs loop(start, end) over [0, count) in blocks_per_thread contiguous blocks
+  per pool thread and waits for just those blocks, so phases sharing the pool
+  do not wait on each other. Must not be called from a task on the same pool.
+*/
+template <typename F>
+inline void parallel_for(BS::thread_pool &pool, size_t count, F &&loop, size_t blocks_per_thread = 1)
+{
+  if (count == 0)
+    return;
+  uint32_t party = Tracer::party();
+  pool.parallelize_loop(
+          count, [&loop, party](const size_t start, const size_t end)
+          {
+            Tracer::party() = party;
+            loop(start, end); },
+          pool.get_thread_count() * blocks_per_thread)
+      .wait();
+}
+
+// parallel_for with every block traced as a span called name
+template <typename F>
+inline void parallel_for(const char *name, BS::thread_pool &pool, size_t count, F &&loop, size_t blocks_per_thread = 1)
+{
+  parallel_for(
+      pool, count, [&loop, name](const size_t start, const size_t end)
+      {
+        TraceSpan span(name);
+        loop(start, end); },
+      blocks_per_thread);
+}
+
 template <typename T>
 struct Tuple
 {
@@ -54,39 +113,126 @@ struct AggKeys
 
 /* -------------------------------------- */
 
-shared_ptr<CCParams<CryptoContextBFVRNS>> gen_bfv_params(size_t ring_dim)
+// Deterministic Miller-Rabin for 64-bit n
+inline bool is_prime_u64(uint64_t n)
+{
+  if (n < 2)
+    return false;
+  for (uint64_t p : {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37})
+  {
+    if (n % p == 0)
+      return n == p;
+  }
+  auto mul = [n](uint64_t a, uint64_t b)
+  { return (uint64_t)(((unsigned __int128)a * b) % n); };
+  uint64_t d = n - 1;
+  size_t s = 0;
+  for (; d % 2 == 0; s++)
+    d /= 2;
+  for (uint64_t a : {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37})
+  {
+    uint64_t x = 1, b = a, e = d;
+    for (; e > 0; e >>= 1, b = mul(b, b))
+    {
+      if (e & 1)
+        x = mul(x, b);
+    }
+    if (x == 1 || x == n - 1)
+      continue;
+    size_t r = 1;
+    for (; r < s && x != n - 1; r++)
+      x = mul(x, x);
+    if (x != n - 1)
+      return false;
+  }
+  return true;
+}
+
+// Bits of a tag compact packing stores per coefficient mod plain_mod
+inline size_t plain_mod_bits(uint64_t plain_mod)
+{
+  return 63 - (size_t)__builtin_clzll(plain_mod);
+}
+
+/*
+  Batching needs a prime plaintext modulus p = 1 mod 2 * ring_dim. This is
+  the smallest one above 2^cf_bits, so that compact packing stores cf_bits
+  bits per coefficient: 65537 for 16 bits and ring dimensions up to 32768.
+*/
+inline uint64_t bfv_plain_modulus(size_t ring_dim, size_t cf_bits)
+{
+  uint64_t m = 2 * (uint64_t)ring_dim;
+  if (cf_bits < plain_mod_bits(m) || cf_bits > 60)
+    throw runtime_error("Plaintext moduli of " + to_string(cf_bits) + " bits are not supported with ring dimension " + to_string(ring_dim) + ".");
+  for (uint64_t p = (1ULL << cf_bits) + 1; plain_mod_bits(p) == cf_bits; p += m)
+  {
+    if (is_prime_u64(p))
+      return p;
+  }
+  throw runtime_error("No " + to_string(cf_bits) + "-bit plaintext modulus for ring dimension " + to_string(ring_dim) + ".");
+}
+
+// Security level for 128, 192 or 256 bits
+inline SecurityLevel security_level(size_t bits)
+{
+  switch (bits)
+  {
+  case 128:
+    return HEStd_128_classic;
+  case 192:
+    return HEStd_192_classic;
+  case 256:
+    return HEStd_256_classic;
+  default:
+    throw runtime_error("Security level " + to_string(bits) + " not supported.");
+  }
+}
+
+shared_ptr<CCParams<CryptoContextBFVRNS>> make_bfv_params(size_t ring_dim, size_t depth = 1, uint64_t plain_mod = 65537, SecurityLevel sec = HEStd_192_classic)
 {
   shared_ptr<CCParams<CryptoContextBFVRNS>> parms = make_shared<CCParams<CryptoContextBFVRNS>>();
   // parms->SetToDefaults(BFVRNS_SCHEME);
-  parms->SetPlaintextModulus(65537);
-  // parms->SetPlaintextModulus(4294967297);
-  parms->SetMultiplicativeDepth(1);
+  parms->SetPlaintextModulus(plain_mod);
+  parms->SetMultiplicativeDepth(depth);
   parms->SetEvalAddCount(0);
   // parms->SetBatchSize(2048);
   // parms->SetDigitSize(2048);
   parms->SetRingDim(ring_dim);
   // parms->SetFirstModSize(35);
   // parms->SetScalingModSize(0);
-  parms->SetSecurityLevel(HEStd_192_classic);
+  parms->SetSecurityLevel(sec);
   // parameters.SetMaxRelinSkDeg(3);
   // cout << "Secret Key Distribution: " << parms->GetSecretKeyDist() << endl;
+  return parms;
+}
+
+shared_ptr<CCParams<CryptoContextBFVRNS>> gen_bfv_params(size_t ring_dim, size_t depth = 1, uint64_t plain_mod = 65537, SecurityLevel sec = HEStd_192_classic)
+{
+  shared_ptr<CCParams<CryptoContextBFVRNS>> parms = make_bfv_params(ring_dim, depth, plain_mod, sec);
   cout << "Ring Dimension: " << parms->GetRingDim() << endl;
   cout << "Plaintext Modulus: " << parms->GetPlaintextModulus() << endl;
   cout << "First Mod Size: " << parms->GetFirstModSize() << endl;
+  cout << "Multiplicative Depth: " << parms->GetMultiplicativeDepth() << endl;
   cout << "Security Level: " << parms->GetSecurityLevel() << endl;
   print_sep();
   return parms;
 }
 
-shared_ptr<CCParams<CryptoContextCKKSRNS>> gen_ckks_params(size_t ring_dim)
+shared_ptr<CCParams<CryptoContextCKKSRNS>> make_ckks_params(size_t ring_dim, SecurityLevel sec = HEStd_192_classic)
 {
   shared_ptr<CCParams<CryptoContextCKKSRNS>> parms = make_shared<CCParams<CryptoContextCKKSRNS>>();
   parms->SetMultiplicativeDepth(3);
-  parms->SetSecurityLevel(HEStd_192_classic);
+  parms->SetSecurityLevel(sec);
   parms->SetRingDim(ring_dim);
   // parms->SetBatchSize(32768);
   parms->SetScalingModSize(59);
   parms->SetMaxRelinSkDeg(3);
+  return parms;
+}
+
+shared_ptr<CCParams<CryptoContextCKKSRNS>> gen_ckks_params(size_t ring_dim, SecurityLevel sec = HEStd_192_classic)
+{
+  shared_ptr<CCParams<CryptoContextCKKSRNS>> parms = make_ckks_params(ring_dim, sec);
   cout << "Ring Dimension: " << parms->GetRingDim() << endl;
   cout << "Scaling Mod Size: " << parms->GetScalingModSize() << endl;
   cout << "Security Level: " << parms->GetSecurityLevel() << endl;
@@ -128,6 +274,176 @@ vector<uint8_t> sha384(const string x)
   return digest;
 }
 
+/* -------------------------------------- */
+
+/*
+  Crypto contexts by parameter set: each is built once per process and, when
+  a cache directory is set, serialized there so later runs with the same
+  parameters load it instead of regenerating it.
+*/
+struct ContextCache
+{
+  static inline mutex mtx;
+  static inline map<string, CryptoContext<DCRTPoly>> ctxs;
+  static inline string dir;
+  // Contexts and key sets this process read from dir, and ones it generated
+  static inline size_t n_loaded = 0, n_generated = 0;
+
+  // "warm" when nothing had to be generated, "cold" otherwise
+  static string state()
+  {
+    if (dir.empty())
+      return "uncached";
+    return (n_generated == 0) ? "warm" : "cold";
+  }
+
+  // File name stem for everything derived from parms under prefix
+  template <typename P>
+  static string stem(const string &prefix, const CCParams<P> &parms)
+  {
+    stringstream ss;
+    ss << prefix << parms;
+    vector<uint8_t> h = sha384(ss.str());
+    char hex[17];
+    for (size_t i = 0; i < 8; i++)
+      sprintf(hex + (2 * i), "%02x", h[i]);
+    return prefix + "-" + string(hex);
+  }
+
+  static bool has_file(const string &name)
+  {
+    return !dir.empty() && ifstream(dir + "/" + name).good();
+  }
+
+  // Writes obj to path through a temporary file, so that concurrent processes
+  // never read a partial file
+  template <typename T>
+  static void store(const string &path, const T &obj)
+  {
+    string tmp = path + "." + to_string(getpid()) + ".tmp";
+    Serial::SerializeToFile(tmp, obj, SerType::BINARY);
+    rename(tmp.c_str(), path.c_str());
+  }
+
+  template <typename P>
+  static CryptoContext<DCRTPoly> get(const string &prefix, shared_ptr<CCParams<P>> &parms)
+  {
+    string key = stem(prefix, *parms);
+    lock_guard<mutex> lock(mtx);
+    auto it = ctxs.find(key);
+    if (it != ctxs.end())
+      return it->second;
+
+    CryptoContext<DCRTPoly> ctx;
+    if (has_file(key + ".ctx"))
+    {
+      Serial::DeserializeFromFile(dir + "/" + key + ".ctx", ctx, SerType::BINARY);
+      n_loaded++;
+    }
+    else
+    {
+      ctx = gen_crypto_ctx(parms);
+      n_generated++;
+      if (!dir.empty())
+        store(dir + "/" + key + ".ctx", ctx);
+    }
+    ctxs[key] = ctx;
+    return ctx;
+  }
+};
+
+inline void set_ctx_cache_dir(const string &dir)
+{
+  if (!dir.empty())
+    mkdir(dir.c_str(), 0700);
+  ContextCache::dir = dir;
+}
+
+inline CryptoContext<DCRTPoly> cached_crypto_ctx(shared_ptr<CCParams<CryptoContextBFVRNS>> &parms)
+{
+  return ContextCache::get("bfv", parms);
+}
+
+inline CryptoContext<DCRTPoly> cached_crypto_ctx(shared_ptr<CCParams<CryptoContextCKKSRNS>> &parms)
+{
+  return ContextCache::get("ckks", parms);
+}
+
+/* -------------------------------------- */
+
+// SHA3-384 / SHAKE256 with a digest context that is reused across calls
+struct Sha3Hasher
+{
+  EVP_MD_CTX *context;
+  const EVP_MD *algorithm, *xof_algorithm;
+
+  Sha3Hasher()
+  {
+    context = EVP_MD_CTX_new();
+    algorithm = EVP_sha3_384();
+    xof_algorithm = EVP_shake256();
+  }
+
+  ~Sha3Hasher()
+  {
+    EVP_MD_CTX_free(context);
+  }
+
+  Sha3Hasher(const Sha3Hasher &) = delete;
+  Sha3Hasher &operator=(const Sha3Hasher &) = delete;
+
+  // Writes SHA3-384(x || suffix) to out, without materializing the concatenation
+  inline void digest(string_view x, string_view suffix, uint8_t *out)
+  {
+    uint32_t digest_length = SHA384_DIGEST_LENGTH;
+    EVP_DigestInit_ex(context, algorithm, nullptr);
+    EVP_DigestUpdate(context, x.data(), x.size());
+    EVP_DigestUpdate(context, suffix.data(), suffix.size());
+    EVP_DigestFinal_ex(context, out, &digest_length);
+  }
+
+  // Writes out_len bytes of SHAKE256(x || suffix) to out
+  inline void xof(string_view x, string_view suffix, uint8_t *out, size_t out_len)
+  {
+    EVP_DigestInit_ex(context, xof_algorithm, nullptr);
+    EVP_DigestUpdate(context, x.data(), x.size());
+    EVP_DigestUpdate(context, suffix.data(), suffix.size());
+    EVP_DigestFinalXOF(context, out, out_len);
+  }
+};
+
+static const size_t MAX_TAG_BYTES = 48;
+
+/*
+  Tag bits that keep the chance of any false match below 2^-stat_sec. Each
+  of the map_sz slots is compared against the tags of num_parties - 1
+  providers, bin_sz tags per provider with cuckoo hashing, and two unequal
+  uniform tags agree with probability 2^-bits.
+*/
+inline size_t tag_bits_for(size_t map_sz, size_t num_parties, size_t bin_sz, size_t stat_sec)
+{
+  double comparisons = (double)map_sz * (double)max(num_parties - 1, (size_t)1) * (double)max(bin_sz, (size_t)1);
+  return stat_sec + (size_t)ceil(log2(comparisons));
+}
+
+// Shortest tag, in bytes, for tag_bits_for. The length is kept even, which
+// compact packing at the default 16 bits per coefficient stores without
+// padding; bounds that need more than MAX_TAG_BYTES are rejected.
+inline size_t tag_bytes_for(size_t map_sz, size_t num_parties, size_t bin_sz, size_t stat_sec)
+{
+  size_t bytes = (tag_bits_for(map_sz, num_parties, bin_sz, stat_sec) + 7) / 8;
+  bytes += bytes % 2;
+  if (bytes > MAX_TAG_BYTES)
+    throw runtime_error("A false match bound of 2^-" + to_string(stat_sec) + " needs " + to_string(bytes) + "-byte tags, above the " + to_string(MAX_TAG_BYTES) + "-byte maximum.");
+  return bytes;
+}
+
+// Coefficients a compact-packed hash of nbits takes
+inline size_t compact_cf_count(size_t nbits, size_t cf_bits)
+{
+  return (nbits + cf_bits - 1) / cf_bits;
+}
+
 inline size_t n_hashes_in_pt(PackingType pack_type, size_t poly_mod_deg, size_t plain_mod_bits, size_t nbits_entry)
 {
   switch (pack_type)
@@ -137,7 +453,7 @@ inline size_t n_hashes_in_pt(PackingType pack_type, size_t poly_mod_deg, size_t
   case MULTIPLE:
     return (poly_mod_deg / nbits_entry);
   case MULTIPLE_COMPACT:
-    return ((plain_mod_bits * poly_mod_deg) / nbits_entry);
+    return (poly_mod_deg / compact_cf_count(nbits_entry, plain_mod_bits));
   default:
     throw runtime_error("Packing not supported.");
   }
@@ -145,17 +461,22 @@ inline size_t n_hashes_in_pt(PackingType pack_type, size_t poly_mod_deg, size_t
 
 /* -------------------------------------- */
 
-inline void pack_bitwise_int_arr(vector<int64_t> *int_vec, vector<uint8_t> *to_pack, size_t start_idx)
+inline void pack_bitwise_int_arr(vector<int64_t> *int_vec, const uint8_t *to_pack, size_t nbytes, size_t start_idx)
 {
-  for (size_t i = 0; i < to_pack->size(); i++)
+  for (size_t i = 0; i < nbytes; i++)
   {
     for (uint8_t k = 0; k < 8; k++)
     {
-      (*int_vec)[start_idx + (i * 8 + k)] = (is_bit_set(to_pack->at(i), k) ? 1 : 0);
+      (*int_vec)[start_idx + (i * 8 + k)] = (is_bit_set(to_pack[i], k) ? 1 : 0);
     }
   }
 }
 
+inline void pack_bitwise_int_arr(vector<int64_t> *int_vec, vector<uint8_t> *to_pack, size_t start_idx)
+{
+  pack_bitwise_int_arr(int_vec, to_pack->data(), to_pack->size(), start_idx);
+}
+
 inline void unpack_bitwise_int_arr(vector<int64_t> *int_vec, vector<uint8_t> *unpacked)
 {
   size_t bitsize = int_vec->size();
@@ -168,11 +489,12 @@ inline void unpack_bitwise_int_arr(vector<int64_t> *int_vec, vector<uint8_t> *un
   }
 }
 
-inline void pack_bitwise_single(CryptoContext<DCRTPoly> &bfv_ctx, PT *pt, vector<uint8_t> *to_pack)
+// int_vec is caller-owned scratch, reused across calls
+inline void pack_bitwise_single(CryptoContext<DCRTPoly> &bfv_ctx, PT *pt, const uint8_t *to_pack, size_t nbytes, vector<int64_t> *int_vec)
 {
-  vector<int64_t> int_vec(to_pack->size() * 8);
-  pack_bitwise_int_arr(&int_vec, to_pack, 0);
-  *pt = bfv_ctx->MakePackedPlaintext(int_vec);
+  int_vec->resize(nbytes * 8);
+  pack_bitwise_int_arr(int_vec, to_pack, nbytes, 0);
+  *pt = bfv_ctx->MakePackedPlaintext(*int_vec);
 }
 
 void unpack_bitwise_single(PT &pt, vector<uint8_t> *unpacked, size_t nbits)
@@ -182,20 +504,21 @@ void unpack_bitwise_single(PT &pt, vector<uint8_t> *unpacked, size_t nbits)
   unpack_bitwise_int_arr(&int_vec, unpacked);
 }
 
-void pack_bitwise_multiple(CryptoContext<DCRTPoly> &bfv_ctx, PT *pt, vector<vector<uint8_t>> *to_pack, size_t start_idx, size_t count, size_t nbits, bool fill_random)
+// to_pack points at count consecutive hashes of nbits each; int_vec is scratch
+void pack_bitwise_multiple(CryptoContext<DCRTPoly> &bfv_ctx, PT *pt, const uint8_t *to_pack, size_t count, size_t nbits, bool fill_random, vector<int64_t> *int_vec)
 {
   size_t ring_dim = bfv_ctx->GetRingDimension();
-  vector<int64_t> int_vec(ring_dim);
+  size_t nbytes = bits_to_bytes(nbits);
+  int_vec->resize(ring_dim);
   for (size_t i = 0; i < count; i++)
   {
-    pack_bitwise_int_arr(&int_vec, &to_pack->at(start_idx + i), i * nbits);
+    pack_bitwise_int_arr(int_vec, to_pack + (i * nbytes), nbytes, i * nbits);
   }
   if (fill_random)
-  {
-    for (size_t i = nbits * count; i < ring_dim; i++)
-      int_vec[i] = random_int(2);
-  }
-  *pt = bfv_ctx->MakePackedPlaintext(int_vec);
+    random_ints(int_vec->data() + (nbits * count), ring_dim - (nbits * count), 2);
+  else
+    fill(int_vec->begin() + (nbits * count), int_vec->end(), 0);
+  *pt = bfv_ctx->MakePackedPlaintext(*int_vec);
 }
 
 void unpack_bitwise_multiple(PT &pt, vector<vector<uint8_t>> *unpacked, size_t count, size_t nbits)
@@ -211,37 +534,183 @@ void unpack_bitwise_multiple(PT &pt, vector<vector<uint8_t>> *unpacked, size_t c
   }
 }
 
-// Hardcoded 2 bytes i.e. mod 65537
-inline void pack_compact_int_arr(vector<int64_t> *int_vec, vector<uint8_t> *to_pack, size_t start_idx)
+// Splits the bytes, little-endian, into cf_bits-bit coefficients; the last
+// one is zero-padded
+inline void pack_compact_int_arr(vector<int64_t> *int_vec, const uint8_t *to_pack, size_t nbytes, size_t start_idx, size_t cf_bits = 16)
+{
+  uint64_t mask = (1ULL << cf_bits) - 1;
+  unsigned __int128 acc = 0;
+  size_t n_acc = 0, idx = start_idx;
+  for (size_t i = 0; i < nbytes; i++)
+  {
+    acc |= (unsigned __int128)to_pack[i] << n_acc;
+    n_acc += 8;
+    for (; n_acc >= cf_bits; n_acc -= cf_bits, acc >>= cf_bits)
+      (*int_vec)[idx++] = (int64_t)((uint64_t)acc & mask);
+  }
+  if (n_acc > 0)
+    (*int_vec)[idx] = (int64_t)((uint64_t)acc & mask);
+}
+
+inline void pack_compact_int_arr(vector<int64_t> *int_vec, vector<uint8_t> *to_pack, size_t start_idx, size_t cf_bits = 16)
+{
+  pack_compact_int_arr(int_vec, to_pack->data(), to_pack->size(), start_idx, cf_bits);
+}
+
+// Inverse of pack_compact_int_arr; cf holds coefficients mod plain_mod,
+// centered or not
+inline void unpack_compact_int_arr(const int64_t *cf, uint8_t *out, size_t nbytes, size_t cf_bits, uint64_t plain_mod)
 {
-  for (size_t i = 0; i < to_pack->size() / 2; i++)
-    memcpy(&(int_vec->data()[start_idx + i]), &(to_pack->data()[2 * i]), 2);
+  unsigned __int128 acc = 0;
+  size_t n_acc = 0;
+  for (size_t i = 0; i < nbytes; i++)
+  {
+    if (n_acc < 8)
+    {
+      int64_t v = *cf++;
+      acc |= (unsigned __int128)((v < 0) ? (uint64_t)(v + (int64_t)plain_mod) : (uint64_t)v) << n_acc;
+      n_acc += cf_bits;
+    }
+    out[i] = (uint8_t)acc;
+    acc >>= 8;
+    n_acc -= 8;
+  }
 }
 
-// start_idx in to_pack
-inline void pack_multiple_compact(CryptoContext<DCRTPoly> &bfv_ctx, PT *pt, vector<vector<uint8_t>> *to_pack, size_t start_idx, size_t count, size_t num_cf_per_hash, size_t ring_dim, bool fill_random)
+// to_pack points at count consecutive hashes of hash_sz bytes each; int_vec is scratch
+inline void pack_multiple_compact(CryptoContext<DCRTPoly> &bfv_ctx, PT *pt, const uint8_t *to_pack, size_t hash_sz, size_t count, size_t num_cf_per_hash, size_t ring_dim, bool fill_random, vector<int64_t> *int_vec)
 {
-  vector<int64_t> int_vec(ring_dim);
+  uint64_t plain_mod = bfv_ctx->GetCryptoParameters()->GetPlaintextModulus();
+  size_t cf_bits = plain_mod_bits(plain_mod);
+  int_vec->resize(ring_dim);
+  size_t num_cf_used = compact_cf_count(hash_sz * 8, cf_bits);
   for (size_t i = 0; i < count; i++)
-    pack_compact_int_arr(&int_vec, &to_pack->at(start_idx + i), num_cf_per_hash * i);
-  for (size_t i = count * num_cf_per_hash; i < ring_dim; i++)
-    int_vec[i] = random_int(65537);
-  *pt = bfv_ctx->MakePackedPlaintext(int_vec);
+  {
+    pack_compact_int_arr(int_vec, to_pack + (i * hash_sz), hash_sz, num_cf_per_hash * i, cf_bits);
+    fill(int_vec->begin() + (num_cf_per_hash * i + num_cf_used), int_vec->begin() + (num_cf_per_hash * (i + 1)), 0);
+  }
+  random_ints(int_vec->data() + (count * num_cf_per_hash), ring_dim - (count * num_cf_per_hash), plain_mod);
+  *pt = bfv_ctx->MakePackedPlaintext(*int_vec);
 }
 
-inline void unpack_multiple_compact(PT &pt, vector<vector<uint8_t>> *unpacked, size_t num_bytes_per_hash)
+// Unpacks every hash slot of pt, num_cf_per_hash coefficients apart
+inline void unpack_multiple_compact(PT &pt, vector<vector<uint8_t>> *unpacked, size_t num_bytes_per_hash, size_t num_cf_per_hash)
 {
-  vector<int64_t> int_vec = pt->GetPackedValue();
-  size_t num_cf_per_hash = (num_bytes_per_hash / 2);
+  const vector<int64_t> &int_vec = pt->GetPackedValue();
+  uint64_t plain_mod = pt->GetEncodingParams()->GetPlaintextModulus();
+  size_t cf_bits = plain_mod_bits(plain_mod);
   size_t hash_count = (int_vec.size() / num_cf_per_hash);
   unpacked->resize(hash_count);
   for (size_t i = 0; i < hash_count; i++)
   {
     (*unpacked)[i].resize(num_bytes_per_hash);
-    memcpy((*unpacked)[i].data(), &(int_vec.data()[num_cf_per_hash * i]), num_bytes_per_hash);
+    unpack_compact_int_arr(int_vec.data() + (num_cf_per_hash * i), (*unpacked)[i].data(), num_bytes_per_hash, cf_bits, plain_mod);
   }
 }
 
+/* -------------------------------------- */
+
+// Row-per-ciphertext bitmap of matching slots; rows are word-aligned, so each
+// ciphertext's row can be written without synchronization
+struct ZeroBitmap
+{
+  size_t n_rows, row_bits, row_words;
+  vector<uint64_t> words;
+
+  ZeroBitmap(size_t rows, size_t bits) : n_rows(rows), row_bits(bits), row_words((bits + 63) / 64), words(rows * row_words, 0) {}
+
+  inline uint64_t *row(size_t i)
+  {
+    return words.data() + (i * row_words);
+  }
+
+  inline bool test(size_t i, size_t j) const
+  {
+    return (words[(i * row_words) + (j / 64)] >> (j % 64)) & 1;
+  }
+
+  size_t count() const
+  {
+    size_t c = 0;
+    for (uint64_t w : words)
+      c += (size_t)__builtin_popcountll(w);
+    return c;
+  }
+};
+
+/*
+  Zero check on decoded coefficients: sets bit j of row, for j < count, iff
+  cf[j * stride, j * stride + run) are all zero. One variant per instruction
+  set, picked once at runtime.
+*/
+inline void zero_runs_scalar(const int64_t *cf, size_t count, size_t stride, size_t run, uint64_t *row)
+{
+  for (size_t j = 0; j < count; j++)
+  {
+    const int64_t *p = cf + (j * stride);
+    int64_t acc = 0;
+    for (size_t k = 0; k < run; k++)
+      acc |= p[k];
+    row[j / 64] |= (uint64_t)(acc == 0) << (j % 64);
+  }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) inline void zero_runs_avx2(const int64_t *cf, size_t count, size_t stride, size_t run, uint64_t *row)
+{
+  for (size_t j = 0; j < count; j++)
+  {
+    const int64_t *p = cf + (j * stride);
+    __m256i acc = _mm256_setzero_si256();
+    size_t k = 0;
+    for (; k + 4 <= run; k += 4)
+      acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(p + k)));
+    int64_t tail = 0;
+    for (; k < run; k++)
+      tail |= p[k];
+    row[j / 64] |= (uint64_t)(_mm256_testz_si256(acc, acc) && tail == 0) << (j % 64);
+  }
+}
+
+__attribute__((target("avx512f"))) inline void zero_runs_avx512(const int64_t *cf, size_t count, size_t stride, size_t run, uint64_t *row)
+{
+  __mmask8 tail_mask = (__mmask8)((1u << (run % 8)) - 1);
+  for (size_t j = 0; j < count; j++)
+  {
+    const int64_t *p = cf + (j * stride);
+    __m512i acc = _mm512_setzero_si512();
+    size_t k = 0;
+    for (; k + 8 <= run; k += 8)
+      acc = _mm512_or_si512(acc, _mm512_loadu_si512((const void *)(p + k)));
+    if (k < run)
+      acc = _mm512_or_si512(acc, _mm512_maskz_loadu_epi64(tail_mask, (const void *)(p + k)));
+    row[j / 64] |= (uint64_t)(_mm512_test_epi64_mask(acc, acc) == 0) << (j % 64);
+  }
+}
+#endif
+
+typedef void (*ZeroRunsFn)(const int64_t *, size_t, size_t, size_t, uint64_t *);
+
+inline ZeroRunsFn select_zero_runs()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return zero_runs_avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return zero_runs_avx2;
+#endif
+  return zero_runs_scalar;
+}
+
+inline void zero_runs(const int64_t *cf, size_t count, size_t stride, size_t run, uint64_t *row)
+{
+  static const ZeroRunsFn fn = select_zero_runs();
+  fn(cf, count, stride, run, row);
+}
+
+/* -------------------------------------- */
+
 void pack_base_int_arr(vector<int64_t> &int_vec, const size_t a, const size_t b)
 {
   size_t rem = a;
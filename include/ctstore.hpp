@@ -0,0 +1,271 @@
+#pragma once
+
+#include <future>
+#include <sstream>
+#include "crypto.hpp"
+
+using namespace std;
+using namespace lbcrypto;
+
+/* -------------------------------------- */
+
+// Read-only stream over memory it does not own
+struct MemBuf : streambuf
+{
+  MemBuf(const uint8_t *p, size_t n)
+  {
+    char *b = (char *)p;
+    setg(b, b, b + n);
+  }
+};
+
+// A segment file mapped read-only, with the offset and length of every frame
+struct MappedSegment
+{
+  uint8_t *base = nullptr;
+  size_t len = 0;
+  vector<pair<size_t, size_t>> frames;
+
+  MappedSegment(const string &path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw runtime_error("Cannot open segment " + path + ".");
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      ::close(fd);
+      throw runtime_error("Cannot open segment " + path + ".");
+    }
+    len = (size_t)st.st_size;
+    if (len > 0)
+    {
+      base = (uint8_t *)mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base == MAP_FAILED)
+      {
+        base = nullptr;
+        ::close(fd);
+        throw runtime_error("Cannot map segment " + path + ".");
+      }
+      madvise(base, len, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+
+    // The destructor does not run if the constructor throws
+    auto truncated = [this, &path]()
+    {
+      munmap(base, len);
+      base = nullptr;
+      throw runtime_error("Segment " + path + " truncated.");
+    };
+    for (size_t off = 0; off < len;)
+    {
+      uint64_t n;
+      if (off + sizeof(n) > len)
+        truncated();
+      memcpy(&n, base + off, sizeof(n));
+      off += sizeof(n);
+      if (off + n > len)
+        truncated();
+      frames.push_back({off, n});
+      off += n;
+    }
+  }
+
+  ~MappedSegment()
+  {
+    if (base != nullptr)
+      munmap(base, len);
+  }
+
+  MappedSegment(const MappedSegment &) = delete;
+  MappedSegment &operator=(const MappedSegment &) = delete;
+};
+
+/*
+  Out-of-core vector<CT>: count ciphertexts in segments of seg_ct, segment k
+  in the file <prefix>.<k>.seg as length-prefixed binary-serialized
+  ciphertexts. Segments are written whole, through a temporary file, and
+  memory-mapped for reading; deserialization runs on the pool.
+*/
+struct CtStore
+{
+  static const size_t DEFAULT_SEG_CT = 64;
+
+  string prefix;
+  size_t count = 0, seg_ct = DEFAULT_SEG_CT;
+
+  CtStore() {}
+
+  CtStore(const string &file_prefix, size_t n, size_t seg) : prefix(file_prefix), count(n), seg_ct(max(seg, (size_t)1)) {}
+
+  size_t n_segments() const
+  {
+    return (count + seg_ct - 1) / seg_ct;
+  }
+
+  size_t seg_begin(size_t k) const
+  {
+    return k * seg_ct;
+  }
+
+  size_t seg_size(size_t k) const
+  {
+    return min(seg_ct, count - seg_begin(k));
+  }
+
+  string seg_path(size_t k) const
+  {
+    return prefix + "." + to_string(k) + ".seg";
+  }
+
+  void write_segment(size_t k, const vector<CT> &cts, BS::thread_pool &pool)
+  {
+    assert(cts.size() == seg_size(k));
+    vector<string> bufs(cts.size());
+    parallel_for(pool, cts.size(), [&cts, &bufs](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                   {
+                     stringstream ss;
+                     Serial::Serialize(cts[i], ss, SerType::BINARY);
+                     bufs[i] = ss.str();
+                   } });
+    write_frames(k, bufs);
+  }
+
+  void read_segment(size_t k, vector<CT> &cts, BS::thread_pool &pool) const
+  {
+    MappedSegment seg(seg_path(k));
+    if (seg.frames.size() != seg_size(k))
+      throw runtime_error("Segment " + seg_path(k) + " has the wrong size.");
+    cts.resize(seg.frames.size());
+    parallel_for(pool, cts.size(), [&seg, &cts](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                   {
+                     MemBuf buf(seg.base + seg.frames[i].first, seg.frames[i].second);
+                     istream in(&buf);
+                     Serial::Deserialize(cts[i], in, SerType::BINARY);
+                   } });
+  }
+
+  // Writes out[i] = this[idx[i]] without deserializing: frames are copied
+  // between the mapped segments
+  void permute(const vector<size_t> &idx, CtStore &out) const
+  {
+    assert(idx.size() == count && out.count == count);
+    vector<unique_ptr<MappedSegment>> in(n_segments());
+    for (size_t k = 0; k < in.size(); k++)
+    {
+      in[k] = make_unique<MappedSegment>(seg_path(k));
+      madvise(in[k]->base, in[k]->len, MADV_RANDOM);
+    }
+    vector<string> bufs;
+    for (size_t k = 0; k < out.n_segments(); k++)
+    {
+      bufs.resize(out.seg_size(k));
+      for (size_t i = 0; i < bufs.size(); i++)
+      {
+        size_t j = idx[out.seg_begin(k) + i];
+        const MappedSegment &seg = *in[j / seg_ct];
+        auto [off, len] = seg.frames[j % seg_ct];
+        bufs[i].assign((const char *)seg.base + off, len);
+      }
+      out.write_frames(k, bufs);
+    }
+  }
+
+  // Takes over the segments of other, which must have the same layout
+  void replace_with(CtStore &other)
+  {
+    assert(other.count == count && other.seg_ct == seg_ct);
+    for (size_t k = 0; k < n_segments(); k++)
+    {
+      if (rename(other.seg_path(k).c_str(), seg_path(k).c_str()) != 0)
+        throw runtime_error("Cannot move segment " + other.seg_path(k) + ".");
+    }
+  }
+
+  void remove_all()
+  {
+    for (size_t k = 0; k < n_segments(); k++)
+      remove(seg_path(k).c_str());
+  }
+
+  void write_frames(size_t k, const vector<string> &bufs)
+  {
+    string tmp = seg_path(k) + ".tmp";
+    {
+      ofstream out(tmp, ios::binary | ios::trunc);
+      for (const auto &buf : bufs)
+      {
+        uint64_t len = buf.size();
+        out.write((const char *)&len, sizeof(len));
+        out.write(buf.data(), len);
+      }
+      if (!out.good())
+        throw runtime_error("Cannot write segment " + tmp + ".");
+    }
+    if (rename(tmp.c_str(), seg_path(k).c_str()) != 0)
+      throw runtime_error("Cannot move segment " + tmp + ".");
+  }
+};
+
+/*
+  Streams the segments of a set of stores through f(k, io). Slot i of io is
+  read from ins[i] (or is seg_size(k) empty ciphertexts if ins[i] is null)
+  and, once f returns, written to outs[i] unless that is null. Segment k + 1
+  is read ahead and segment k - 1 written behind while f runs on segment k.
+*/
+template <typename F>
+void stream_segments(const vector<const CtStore *> &ins, const vector<CtStore *> &outs, BS::thread_pool &pool, F &&f)
+{
+  assert(ins.size() == outs.size());
+  const CtStore *layout = nullptr;
+  for (size_t i = 0; i < ins.size(); i++)
+    layout = (layout != nullptr) ? layout : ((ins[i] != nullptr) ? ins[i] : outs[i]);
+  if (layout == nullptr || layout->count == 0)
+    return;
+
+  auto load = [&ins, &pool, layout](size_t k, vector<vector<CT>> &io)
+  {
+    io.resize(ins.size());
+    for (size_t i = 0; i < ins.size(); i++)
+    {
+      if (ins[i] != nullptr)
+        ins[i]->read_segment(k, io[i], pool);
+      else
+        io[i].assign(layout->seg_size(k), CT());
+    }
+  };
+  auto store = [&outs, &pool](size_t k, vector<vector<CT>> &io)
+  {
+    for (size_t i = 0; i < outs.size(); i++)
+    {
+      if (outs[i] != nullptr)
+        outs[i]->write_segment(k, io[i], pool);
+    }
+  };
+
+  size_t n_seg = layout->n_segments();
+  vector<vector<CT>> cur, next, behind;
+  future<void> ahead, written;
+  load(0, cur);
+  for (size_t k = 0; k < n_seg; k++)
+  {
+    if (k + 1 < n_seg)
+      ahead = async(launch::async, load, k + 1, ref(next));
+    f(k, cur);
+    if (written.valid())
+      written.get();
+    swap(behind, cur);
+    written = async(launch::async, store, k, ref(behind));
+    if (ahead.valid())
+    {
+      ahead.get();
+      swap(cur, next);
+    }
+  }
+  written.get();
+}
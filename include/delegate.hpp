@@ -5,6 +5,127 @@
 using namespace std;
 using namespace lbcrypto;
 
+/*
+  File-backed pool of BFV encryptions of zero under the delegate's key:
+  a Header, then one length-prefixed serialized ciphertext per entry. Entries
+  before used_off have been handed out and are never returned again.
+*/
+struct ZeroPool
+{
+  struct Header
+  {
+    char magic[8];
+    uint64_t count, used, used_off;
+  };
+
+  static inline const char MAGIC[8] = {'P', 'Q', 'Z', 'E', 'R', 'O', '0', '1'};
+
+  string path;
+
+  ZeroPool(const string &fpath) : path(fpath) {}
+
+  bool read_header(fstream &f, Header &hdr)
+  {
+    f.seekg(0);
+    f.read((char *)&hdr, sizeof(hdr));
+    return f.good() && memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) == 0;
+  }
+
+  void write_header(fstream &f, const Header &hdr)
+  {
+    f.seekp(0);
+    f.write((const char *)&hdr, sizeof(hdr));
+  }
+
+  size_t available()
+  {
+    fstream f(path, ios::in | ios::binary);
+    Header hdr;
+    return read_header(f, hdr) ? hdr.count - hdr.used : 0;
+  }
+
+  // Appends count fresh encryptions of zero, encrypting one batch on the pool
+  // while the previous one is written
+  void generate(const CryptoContext<DCRTPoly> &ctx, const PK &pk, size_t count, BS::thread_pool &pool)
+  {
+    Header hdr;
+    fstream f(path, ios::in | ios::out | ios::binary);
+    if (!read_header(f, hdr))
+    {
+      f = fstream(path, ios::in | ios::out | ios::binary | ios::trunc);
+      memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+      hdr.count = hdr.used = 0;
+      hdr.used_off = sizeof(hdr);
+      write_header(f, hdr);
+    }
+    f.seekp(0, ios::end);
+
+    size_t batch = pool.get_thread_count() * 16;
+    vector<string> bufs;
+    for (size_t done = 0; done < count; done += batch)
+    {
+      bufs.assign(min(batch, count - done), string());
+      parallel_for(pool, bufs.size(), [&ctx, &pk, &bufs](const size_t start, const size_t end)
+                   {
+                     for (size_t i = start; i < end; i++)
+                     {
+                       CT ct;
+                       encrypt_zero_single(ctx, pk, &ct);
+                       stringstream ss;
+                       Serial::Serialize(ct, ss, SerType::BINARY);
+                       bufs[i] = ss.str();
+                     } });
+      for (const auto &buf : bufs)
+      {
+        uint64_t len = buf.size();
+        f.write((const char *)&len, sizeof(len));
+        f.write(buf.data(), len);
+      }
+    }
+    hdr.count += count;
+    write_header(f, hdr);
+  }
+
+  // Moves up to k unused encryptions of zero into zeros and marks them used
+  size_t take(size_t k, vector<CT> &zeros, BS::thread_pool &pool)
+  {
+    fstream f(path, ios::in | ios::out | ios::binary);
+    Header hdr;
+    if (!read_header(f, hdr))
+      return 0;
+    k = min(k, (size_t)(hdr.count - hdr.used));
+
+    vector<string> bufs(k);
+    f.seekg(hdr.used_off);
+    for (size_t i = 0; i < k; i++)
+    {
+      uint64_t len;
+      f.read((char *)&len, sizeof(len));
+      bufs[i].resize(len);
+      f.read(bufs[i].data(), len);
+      hdr.used_off += sizeof(len) + len;
+    }
+    if (!f.good())
+      throw runtime_error("Zero pool " + path + " truncated.");
+    // Mark them used before handing them out, so none is ever used twice
+    hdr.used += k;
+    write_header(f, hdr);
+    f.flush();
+
+    zeros.resize(k);
+    parallel_for("zero_pool", pool, k, [&bufs, &zeros](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                   {
+                     stringstream ss(bufs[i]);
+                     Serial::Deserialize(zeros[i], ss, SerType::BINARY);
+                   } });
+    return k;
+  }
+};
+
+/* -------------------------------------- */
+
 struct Delegate
 {
   SK bfv_sk;
@@ -14,14 +135,76 @@ struct Delegate
   {
     party = Party(pro_parms, bfv_parms, ckks_parms);
 
+    load_or_gen_keys(bfv_parms);
+
+    // gen_rot_keys();
+  }
+
+  /* -------------------------------------- */
+
+  // The BFV key pair (and EvalMult keys for cuckoo hashing) are reused from
+  // the context cache directory when present there, and stored otherwise
+  void load_or_gen_keys(shared_ptr<CCParams<CryptoContextBFVRNS>> &bfv_parms)
+  {
+    bool mult = (party.pro_parms.num_hash_fns > 1);
+    string stem = ContextCache::stem("bfv", *bfv_parms);
+    string path = ContextCache::dir + "/" + stem;
+    if (ContextCache::has_file(stem + ".sk") && (!mult || ContextCache::has_file(stem + ".mult")))
+    {
+      Serial::DeserializeFromFile(path + ".sk", bfv_sk, SerType::BINARY);
+      Serial::DeserializeFromFile(path + ".pk", party.pro_parms.pk, SerType::BINARY);
+      if (mult)
+      {
+        ifstream in_file(path + ".mult", ios::binary);
+        party.bfv_ctx->DeserializeEvalMultKey(in_file, SerType::BINARY);
+      }
+      ContextCache::n_loaded++;
+      return;
+    }
+
     KeyPair<DCRTPoly> kp = party.bfv_ctx->KeyGen();
+    ContextCache::n_generated++;
     bfv_sk = kp.secretKey;
     party.pro_parms.pk = kp.publicKey;
+    if (mult)
+      party.bfv_ctx->EvalMultKeyGen(bfv_sk);
+    if (ContextCache::dir.empty())
+      return;
 
-    // gen_rot_keys();
+    // .sk is written last since its presence marks the set as complete
+    ContextCache::store(path + ".pk", party.pro_parms.pk);
+    if (mult)
+    {
+      string tmp = path + ".mult." + to_string(getpid()) + ".tmp";
+      {
+        ofstream out_file(tmp, ios::binary);
+        party.bfv_ctx->SerializeEvalMultKey(out_file, SerType::BINARY);
+      }
+      rename(tmp.c_str(), (path + ".mult").c_str());
+    }
+    ContextCache::store(path + ".sk", bfv_sk);
   }
 
-  /* -------------------------------------- */
+  // Encryptions of zero live next to the cached key pair they were made with
+  string zero_pool_path()
+  {
+    return ContextCache::dir + "/" + ContextCache::stem("bfv", *party.bfv_parms) + ".zeros";
+  }
+
+  // Offline phase: stores count encryptions of zero for later start() calls
+  void precompute_zeros(size_t count)
+  {
+    Stopwatch sw;
+    print_title("Offline");
+    sw.start();
+    TraceSpan span("offline", 0);
+    if (ContextCache::dir.empty())
+      throw runtime_error("Precomputed encryptions need a cache directory.");
+    ZeroPool zp(zero_pool_path());
+    zp.generate(party.bfv_ctx, party.pro_parms.pk, count, *party.pro_parms.pool);
+    cout << "Encryptions of zero available: " << zp.available() << endl;
+    printf("\nTime: %5.2fs\n", sw.elapsed());
+  }
 
   void gen_rot_keys()
   {
@@ -43,29 +226,127 @@ struct Delegate
 
   PT joint_decrypt_final(vector<CT> &partials)
   {
+    TraceSpan span("joint_decrypt_fusion", 0);
     PT res;
     party.ckks_ctx->MultipartyDecryptFusion(partials, &res);
     return res;
   }
 
-  Tuple<vector<CT>> start(vector<string> &X, vector<int64_t> &ad)
+  // The delegate's map of X. With --sparse it also fixes which plaintexts
+  // M holds, in party.pro_parms.ct_pt.
+  HashMap build_map(const SetView &X, vector<int64_t> &ad)
+  {
+    TraceSpan span("delegate_map", 0);
+    HashMap hm(party.pro_parms);
+    if (party.pro_parms.num_hash_fns > 1)
+    {
+      party.pro_parms.hash_seed = hm.insert_cuckoo(X, ad);
+      cout << "Cuckoo seed: " << party.pro_parms.hash_seed << endl;
+    }
+    else if (party.pro_parms.with_ad)
+      hm.insert(X, ad);
+    else
+      hm.insert(X);
+    hm.fill_empty_random();
+
+    if (party.pro_parms.sparse)
+    {
+      // A slot the delegate left empty never matches, so plaintexts of filler
+      // only are not sent
+      size_t batch_size = party.pro_parms.batch_size;
+      hm.ct_pt = make_shared<const vector<size_t>>(hm.occupied_plaintexts(batch_size));
+      party.pro_parms.ct_pt = hm.ct_pt;
+      cout << "# Plaintexts with delegate elements = " << hm.ct_pt->size() << "/" << hm.n_plaintexts(batch_size) << endl;
+    }
+    return hm;
+  }
+
+  Tuple<vector<CT>> start(const SetView &X, vector<int64_t> &ad, Tuple<CtStore> *store = nullptr)
+  {
+    HashMap hm = build_map(X, ad);
+    return start(hm, store);
+  }
+
+  // Encrypts M from a map made by build_map. With store, M goes to disk a
+  // segment at a time (and store's counts are set) instead of being returned
+  Tuple<vector<CT>> start(HashMap &hm, Tuple<CtStore> *store = nullptr)
   {
     Stopwatch sw;
     print_title("DelegateStart");
     sw.start();
+    TraceSpan span("DelegateStart", 0);
 
-    HashMap hm(party.pro_parms);
-    if (party.pro_parms.with_ad)
-      hm.insert(X, ad);
+    // Plaintexts are built, encrypted and freed one chunk of M at a time
+    size_t batch_size = party.pro_parms.batch_size;
+    size_t n_ct = hm.n_ciphertexts(batch_size);
+    size_t chunk_sz = (party.pro_parms.chunk_ct > 0) ? party.pro_parms.chunk_ct : n_ct;
+    cout << "# Plaintexts = " << n_ct << endl;
+    cout << "# Hashes / Plaintext = " << batch_size << endl;
+
+    Tuple<vector<CT>> ret;
+    if (store != nullptr)
+    {
+      chunk_sz = store->e0.seg_ct;
+      store->e0.count = n_ct;
+      store->e1 = CtStore(store->e1.prefix, party.pro_parms.with_ad ? n_ct : 0, chunk_sz);
+    }
     else
-      hm.insert(X);
+    {
+      ret.e0.resize(n_ct);
+      ret.e1.resize(party.pro_parms.with_ad ? n_ct : 0);
+    }
     vector<PT> X_pt, V_pt;
-    hm.serialize(party.bfv_ctx, party.ckks_ctx, X_pt, V_pt, true, party.pro_parms.batch_size, party.pro_parms.num_threads);
+    vector<CT> part, zeros;
+    // Segments are written behind the encryption of the next one
+    Tuple<vector<CT>> behind;
+    future<void> written;
+    size_t n_zeros = 0;
+    for (size_t begin = 0; begin < n_ct; begin += chunk_sz)
+    {
+      size_t end = min(begin + chunk_sz, n_ct);
+      hm.serialize_range(party.bfv_ctx, X_pt, false, batch_size, begin, end);
+      zeros.clear();
+      if (!ContextCache::dir.empty())
+      {
+        ZeroPool zp(zero_pool_path());
+        n_zeros += zp.take(end - begin, zeros, *party.pro_parms.pool);
+      }
+      if (zeros.empty())
+        party.encrypt_all(party.bfv_ctx, party.pro_parms.pk, part, X_pt);
+      else
+        party.encrypt_all_from_zeros(party.bfv_ctx, party.pro_parms.pk, zeros, part, X_pt);
+      if (store == nullptr)
+        move(part.begin(), part.end(), ret.e0.begin() + begin);
+      else
+      {
+        if (written.valid())
+          written.get();
+        swap(behind.e0, part);
+      }
 
-    Tuple<vector<CT>> ret;
-    party.encrypt_all(party.bfv_ctx, party.pro_parms.pk, ret.e0, X_pt);
-    if (party.pro_parms.with_ad)
-      party.encrypt_all(party.ckks_ctx, party.pro_parms.apk, ret.e1, V_pt);
+      if (party.pro_parms.with_ad)
+      {
+        hm.serialize_range(party.ckks_ctx, V_pt, true, batch_size, begin, end);
+        party.encrypt_all(party.ckks_ctx, party.pro_parms.apk, part, V_pt);
+        if (store == nullptr)
+          move(part.begin(), part.end(), ret.e1.begin() + begin);
+        else
+          swap(behind.e1, part);
+      }
+      if (store != nullptr)
+      {
+        written = async(launch::async, [this, store, &behind](size_t k)
+                        {
+                          store->e0.write_segment(k, behind.e0, *party.pro_parms.pool);
+                          if (party.pro_parms.with_ad)
+                            store->e1.write_segment(k, behind.e1, *party.pro_parms.pool); },
+                        begin / chunk_sz);
+      }
+    }
+    if (written.valid())
+      written.get();
+    if (n_zeros > 0)
+      cout << "Precomputed encryptions used: " << n_zeros << "/" << n_ct << endl;
 
     // cout << "Ciphertext size: " << ret.e0[0]->GetMetadataByKey()
     printf("\nTime: %5.2fs\n", sw.elapsed());
@@ -77,6 +358,7 @@ struct Delegate
     Stopwatch sw;
     print_title("DelegateFinish");
     sw.start();
+    TraceSpan span("DelegateFinish", 0);
 
     if (party.pro_parms.with_ad)
       party.ckks_ctx->InsertEvalSumKey(party.pro_parms.ask);
@@ -86,4 +368,20 @@ struct Delegate
 
     return int_size;
   }
+
+  size_t finish(const Tuple<CtStore> &B, vector<CT> &agg_res)
+  {
+    Stopwatch sw;
+    print_title("DelegateFinish");
+    sw.start();
+    TraceSpan span("DelegateFinish", 0);
+
+    if (party.pro_parms.with_ad)
+      party.ckks_ctx->InsertEvalSumKey(party.pro_parms.ask);
+
+    size_t int_size = party.decrypt_check_store(bfv_sk, B, agg_res[0]);
+    printf("Time: %5.2fs\n", sw.elapsed());
+
+    return int_size;
+  }
 };
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <vector>
 #include <cassert>
 #include <set>
+#include <memory>
+#include <cstdlib>
 
 #include <cryptopp/osrng.h>
 
@@ -10,72 +12,429 @@ using namespace std;
 
 /* -------------------------------------- */
 
+// n fixed-size slots of sz bytes in one contiguous, cache-line aligned buffer,
+// with a bitmap recording which slots hold an inserted value.
+struct SlotStore
+{
+  static const size_t ALIGNMENT = 64;
+
+  size_t n, sz;
+  unique_ptr<uint8_t[], decltype(&free)> buf;
+  vector<uint64_t> used;
+
+  SlotStore() : n(0), sz(0), buf(nullptr, &free) {}
+
+  SlotStore(size_t num_slots, size_t slot_sz) : n(num_slots), sz(slot_sz), buf(nullptr, &free)
+  {
+    size_t nbytes = n * sz;
+    nbytes += (ALIGNMENT - (nbytes % ALIGNMENT)) % ALIGNMENT;
+    buf.reset((uint8_t *)aligned_alloc(ALIGNMENT, (nbytes > 0) ? nbytes : ALIGNMENT));
+    if (buf == nullptr)
+      throw bad_alloc();
+    used = vector<uint64_t>((n + 63) / 64, 0);
+  }
+
+  inline uint8_t *slot(size_t i)
+  {
+    return buf.get() + (i * sz);
+  }
+
+  inline const uint8_t *slot(size_t i) const
+  {
+    return buf.get() + (i * sz);
+  }
+
+  inline bool is_used(size_t i) const
+  {
+    return is_bit_set((size_t)used[i / 64], i % 64);
+  }
+
+  inline void mark_used(size_t i)
+  {
+    used[i / 64] |= (1ULL << (i % 64));
+  }
+
+  inline void set(size_t i, const uint8_t *val)
+  {
+    memcpy(slot(i), val, sz);
+    mark_used(i);
+  }
+
+  size_t n_used() const
+  {
+    size_t count = 0;
+    for (auto w : used)
+      count += __builtin_popcountll(w);
+    return count;
+  }
+};
+
+/* -------------------------------------- */
+
+// Map size for cuckoo hashing set_sz elements with num_hash_fns candidate slots
+inline size_t cuckoo_map_size(size_t num_hash_fns, size_t set_sz)
+{
+  double expansion = 1.1;
+  if (num_hash_fns == 2)
+    expansion = 2.4;
+  else if (num_hash_fns == 3)
+    expansion = 1.3;
+  return (size_t)ceil(expansion * set_sz);
+}
+
+// Smallest bin capacity such that throwing n_balls into n_bins overflows any
+// bin with probability at most 2^-stat_sec (Poisson tail with a union bound)
+inline size_t max_bin_load(size_t n_balls, size_t n_bins, size_t stat_sec = 40)
+{
+  double lambda = (double)n_balls / n_bins;
+  double target = pow(2.0, -(double)stat_sec) / n_bins;
+  size_t max_j = (size_t)ceil(lambda + 20 * sqrt(lambda) + 64);
+  vector<double> pmf(max_j + 2, 0);
+  pmf[0] = exp(-lambda);
+  for (size_t j = 1; j <= max_j; j++)
+    pmf[j] = pmf[j - 1] * lambda / j;
+  double tail = 0;
+  size_t b = max_j;
+  while (b > 0 && tail + pmf[b] <= target)
+    tail += pmf[b--];
+  return max(b, (size_t)1);
+}
+
+/* -------------------------------------- */
+
 struct HashMap
 {
+  // One SHAKE256 call per element yields both its candidate slots and its tag:
+  // each group of 8 output bytes selects a slot, the next sz bytes are the tag.
+  static inline const string SLOT_DOMAIN = "||~~SLOT~~||";
+  static const size_t MAX_KICKS = 1000;
+  static const size_t MAX_REHASH = 16;
+
   size_t n, sz, n_bits, num_pt, plain_mod_bits, poly_mod_deg, plain_mod;
-  vector<vector<uint8_t>> data;
+  size_t num_hash_fns, bin_sz;
+  shared_ptr<BS::thread_pool> pool;
+  uint32_t seed;
+  string domain;
+  SlotStore data;
   PackingType pack_type;
   vector<uint32_t> ad_data;
 
+  // Provider bins with cuckoo hashing: data holds the first tag of every bin,
+  // the rest of bin j are bin_tags[sz * bin_offset[j] ...], bin_load[j] tags in all
+  vector<uint16_t> bin_load;
+  vector<size_t> bin_offset;
+  vector<uint8_t> bin_tags;
+
+  // Sparse delegate map: the plaintext behind each ciphertext of M (null =
+  // every plaintext, in order)
+  shared_ptr<const vector<size_t>> ct_pt;
+
   HashMap(ProtocolParameters &pro_parms)
   {
+    ct_pt = pro_parms.ct_pt;
     n = pro_parms.map_sz;
     sz = pro_parms.hash_sz;
+    ensure_pool(pro_parms);
+    pool = pro_parms.pool;
     pack_type = pro_parms.pack_type;
+    num_hash_fns = max(pro_parms.num_hash_fns, (size_t)1);
+    bin_sz = max(pro_parms.bin_sz, (size_t)1);
     n_bits = get_bitsize(n);
-    data = vector<vector<uint8_t>>(n);
+    assert(sz <= SHA512_DIGEST_LENGTH);
+    set_seed(pro_parms.hash_seed);
+    data = SlotStore(n, sz);
   }
 
   /* -------------------------------------- */
 
-  // Returns the index of x in the hashmap
-  inline size_t get_map_index(const string &x)
+  inline void set_seed(uint32_t s)
+  {
+    seed = s;
+    domain = SLOT_DOMAIN + ((seed == 0) ? "" : to_string(seed));
+  }
+
+  inline size_t map_index_from_digest(const uint8_t *h)
+  {
+    size_t idx;
+    memcpy(&idx, h, sizeof(size_t));
+    return idx % n;
+  }
+
+  inline size_t slot_hash_len()
+  {
+    return (num_hash_fns * sizeof(size_t)) + sz;
+  }
+
+  // Writes the index bytes followed by the tag of x to out (slot_hash_len() bytes)
+  inline void slot_hash(Sha3Hasher &hasher, string_view x, uint8_t *out)
+  {
+    hasher.xof(x, domain, out, slot_hash_len());
+  }
+
+  // Returns the (first candidate) index of x in the hashmap
+  inline size_t get_map_index(string_view x)
   {
-    vector<uint8_t> h = sha384(x + "||~~MAP~~||");
-    h.resize(sizeof(size_t));
-    return *((size_t *)h.data()) % n;
+    Sha3Hasher hasher;
+    vector<uint8_t> h(slot_hash_len());
+    slot_hash(hasher, x, h.data());
+    return map_index_from_digest(h.data());
   }
 
   /* -------------------------------------- */
 
-  void insert(const vector<string> &X)
+  // Set is any indexable collection of elements convertible to string_view,
+  // e.g. vector<string> or a SetView over a mapped set file
+
+  // Hashes X in parallel: idx[i * num_hash_fns + c] is the c-th candidate slot
+  // of X[i] and its tag is tags[i * sz ...]
+  template <typename Set>
+  void hash_all(const Set &X, vector<size_t> &idx, vector<uint8_t> &tags)
   {
-    for (auto x : X)
-      data[get_map_index(x)] = sha384(x + "||**VALUE**||");
+    size_t count = X.size();
+    idx.resize(count * num_hash_fns);
+    tags.resize(count * sz);
+
+    // Each pool block owns one Sha3Hasher and one digest buffer
+    parallel_for("hash", *pool, count, [this, &X, &idx, &tags](const size_t start, const size_t end)
+                 {
+                   Sha3Hasher hasher;
+                   vector<uint8_t> h(slot_hash_len());
+                   for (size_t i = start; i < end; i++)
+                   {
+                     slot_hash(hasher, X[i], h.data());
+                     for (size_t c = 0; c < num_hash_fns; c++)
+                       idx[i * num_hash_fns + c] = map_index_from_digest(h.data() + (c * sizeof(size_t)));
+                     memcpy(tags.data() + (i * sz), h.data() + (num_hash_fns * sizeof(size_t)), sz);
+                   } });
   }
 
-  void insert(const vector<string> &X, const vector<int64_t> &ad)
+  /*
+    Hashes X in parallel into slot indices and a scratch buffer of tags, then
+    copies each slot's tag from the last element that maps to it, as with
+    sequential inserts. idx[i] is the slot of X[i]; owner[i] is set if X[i]
+    won that slot.
+  */
+  template <typename Set>
+  void insert_hashes(const Set &X, vector<size_t> &idx, vector<bool> &owner)
+  {
+    size_t count = X.size();
+    owner = vector<bool>(count, false);
+    vector<uint8_t> tags;
+    hash_all(X, idx, tags);
+
+    for (size_t i = count; i-- > 0;)
+    {
+      size_t slot = idx[i * num_hash_fns];
+      if (!data.is_used(slot))
+      {
+        data.set(slot, tags.data() + (i * sz));
+        owner[i] = true;
+      }
+    }
+    if (num_hash_fns > 1)
+    {
+      for (size_t i = 0; i < count; i++)
+        idx[i] = idx[i * num_hash_fns];
+      idx.resize(count);
+    }
+  }
+
+  template <typename Set>
+  void insert(const Set &X)
+  {
+    vector<size_t> idx;
+    vector<bool> owner;
+    insert_hashes(X, idx, owner);
+  }
+
+  template <typename Set>
+  void insert(const Set &X, const vector<int64_t> &ad)
   {
     assert(X.size() == ad.size());
     ad_data.resize(n);
+    vector<size_t> idx;
+    vector<bool> owner;
+    insert_hashes(X, idx, owner);
     for (size_t i = 0; i < X.size(); i++)
     {
-      size_t idx = get_map_index(X[i]);
-      data[idx] = sha384(X[i] + "||**VALUE**||");
-      ad_data[idx] = (uint32_t)ad[i];
+      if (owner[i])
+        ad_data[idx[i]] = (uint32_t)ad[i];
     }
   }
 
-  size_t n_empty_slots()
+  /*
+    Delegate side of cuckoo hashing: places every element of X at exactly one
+    of its num_hash_fns candidate slots, evicting occupants along a random
+    walk. If some element is still homeless after MAX_KICKS evictions the
+    table is rebuilt under the next seed; the returned seed is public and the
+    providers must hash under it. ad may be empty.
+  */
+  template <typename Set>
+  uint32_t insert_cuckoo(const Set &X, const vector<int64_t> &ad)
   {
-    size_t n_empty = 0;
-    for (auto v : data)
+    const uint32_t EMPTY = UINT32_MAX;
+    assert(X.size() < EMPTY && num_hash_fns > 1);
+    assert(ad.size() == 0 || ad.size() == X.size());
+    size_t count = X.size();
+    random_device rd;
+    mt19937 gen(rd());
+
+    for (size_t attempt = 0; attempt < MAX_REHASH; attempt++)
     {
-      if (v.size() == 0)
-        n_empty++;
+      if (attempt > 0)
+        set_seed(seed + 1);
+      vector<size_t> idx;
+      vector<uint8_t> tags;
+      hash_all(X, idx, tags);
+
+      vector<uint32_t> slot_owner(n, EMPTY);
+      bool ok = true;
+      for (size_t e = 0; e < count && ok; e++)
+      {
+        uint32_t cur = (uint32_t)e;
+        size_t prev = n;
+        bool placed = false;
+        for (size_t kick = 0; kick <= MAX_KICKS && !placed; kick++)
+        {
+          for (size_t c = 0; c < num_hash_fns && !placed; c++)
+          {
+            size_t slot = idx[cur * num_hash_fns + c];
+            if (slot_owner[slot] == EMPTY)
+            {
+              slot_owner[slot] = cur;
+              placed = true;
+            }
+          }
+          if (placed)
+            break;
+          size_t c = gen() % num_hash_fns;
+          size_t slot = idx[cur * num_hash_fns + c];
+          if (slot == prev)
+            slot = idx[cur * num_hash_fns + ((c + 1) % num_hash_fns)];
+          swap(cur, slot_owner[slot]);
+          prev = slot;
+        }
+        ok = placed;
+      }
+      if (!ok)
+      {
+        cout << "Cuckoo hashing failed under seed " << seed << ", rehashing" << endl;
+        continue;
+      }
+
+      if (ad.size() > 0)
+        ad_data.resize(n);
+      for (size_t slot = 0; slot < n; slot++)
+      {
+        uint32_t e = slot_owner[slot];
+        if (e == EMPTY)
+          continue;
+        data.set(slot, tags.data() + (e * sz));
+        if (ad.size() > 0)
+          ad_data[slot] = (uint32_t)ad[e];
+      }
+      return seed;
     }
-    return n_empty;
+    throw runtime_error("Cuckoo hashing failed.");
+  }
+
+  /*
+    Provider side of cuckoo hashing: puts every element of X in the bin of
+    each of its distinct candidate slots. A bin keeps up to bin_sz tags; any
+    overflow is dropped and reported.
+  */
+  template <typename Set>
+  void insert_bins(const Set &X)
+  {
+    size_t count = X.size();
+    vector<size_t> idx;
+    vector<uint8_t> tags;
+    hash_all(X, idx, tags);
+
+    bin_load = vector<uint16_t>(n, 0);
+    bin_offset = vector<size_t>(n + 1, 0);
+    size_t dropped = 0;
+    auto for_each_candidate = [this, &idx, count](auto &&f)
+    {
+      for (size_t e = 0; e < count; e++)
+      {
+        for (size_t c = 0; c < num_hash_fns; c++)
+        {
+          size_t slot = idx[e * num_hash_fns + c];
+          if (find(idx.begin() + e * num_hash_fns, idx.begin() + e * num_hash_fns + c, slot) == idx.begin() + e * num_hash_fns + c)
+            f(e, slot);
+        }
+      }
+    };
+
+    for_each_candidate([this, &dropped](size_t e, size_t slot)
+                       {
+                         if (bin_load[slot] >= bin_sz)
+                           dropped++;
+                         else
+                           bin_load[slot]++; });
+    for (size_t j = 0; j < n; j++)
+      bin_offset[j + 1] = bin_offset[j] + ((bin_load[j] > 1) ? bin_load[j] - 1 : 0);
+    bin_tags.resize(bin_offset[n] * sz);
+
+    vector<uint16_t> filled(n, 0);
+    for_each_candidate([this, &tags, &filled](size_t e, size_t slot)
+                       {
+                         const uint8_t *tag = tags.data() + (e * sz);
+                         if (filled[slot] == 0)
+                           data.set(slot, tag);
+                         else if (filled[slot] < bin_load[slot])
+                           memcpy(bin_tags.data() + ((bin_offset[slot] + filled[slot] - 1) * sz), tag, sz);
+                         else
+                           return;
+                         filled[slot]++; });
+
+    if (dropped > 0)
+      cout << "# Dropped (bin overflow) = " << dropped << endl;
+  }
+
+  // Number of tag layers any bin of plaintext i occupies (at least one)
+  size_t pt_max_load(size_t i, size_t batch_size)
+  {
+    size_t max_load = 1;
+    if (bin_load.size() != n)
+      return max_load;
+    size_t end = min(n, (i + 1) * batch_size);
+    for (size_t j = i * batch_size; j < end; j++)
+      max_load = max(max_load, (size_t)bin_load[j]);
+    return max_load;
+  }
+
+  size_t n_empty_slots()
+  {
+    return n - data.n_used();
   }
 
   vector<bool> filled_slots()
   {
     vector<bool> ret(n, false);
     for (size_t i = 0; i < n; i++)
+      ret[i] = data.is_used(i);
+    return ret;
+  }
+
+  // Calls f(start, count) for every maximal run of empty slots
+  template <typename F>
+  void for_each_empty_run(F &&f)
+  {
+    size_t i = 0;
+    while (i < n)
     {
-      if (data[i].size() > 0)
-        ret[i] = true;
+      if (data.is_used(i))
+      {
+        i++;
+        continue;
+      }
+      size_t start = i;
+      while (i < n && !data.is_used(i))
+        i++;
+      f(start, i - start);
     }
-    return ret;
   }
 
   void fill_empty_random()
@@ -84,36 +443,26 @@ struct HashMap
 
     sw.start();
     size_t n_empty = n_empty_slots();
-    cout << "# Empty slots = " << n_empty_slots() << endl;
-    vector<uint8_t> buf(n_empty * sz);
-    random_bytes(buf.data(), n_empty * sz);
-    size_t idx = 0;
-    for (size_t i = 0; i < n; i++)
-    {
-      if (data[i].size() == 0)
-      {
-        data[i] = vector<uint8_t>(sz);
-        memcpy(data[i].data(), buf.data() + (idx * sz), sz);
-        idx++;
-      }
-    }
+    cout << "# Empty slots = " << n_empty << endl;
+    for_each_empty_run([this](size_t start, size_t count)
+                       { random_bytes(data.slot(start), count * sz); });
     if (ad_data.size() == n)
     {
-      for (size_t i = 0; i < n; i++)
+      vector<int64_t> filler(n_empty);
+      random_ints(filler, 65537);
+      size_t idx = 0;
+      for (size_t i = 0; i < n && idx < n_empty; i++)
       {
-        if (ad_data[i] == 0)
-          ad_data[i] = random_int(65537);
+        if (!data.is_used(i))
+          ad_data[i] = (uint32_t)filler[idx++];
       }
     }
   }
 
   void fill_empty_zeros()
   {
-    for (size_t i = 0; i < n; i++)
-    {
-      if (data[i].size() == 0)
-        data[i] = vector<uint8_t>(sz, 0);
-    }
+    for_each_empty_run([this](size_t start, size_t count)
+                       { memset(data.slot(start), 0, count * sz); });
   }
 
   inline void fill_int_arr(vector<int64_t> *int_vec, size_t val, size_t start_idx, size_t num_vals)
@@ -122,108 +471,164 @@ struct HashMap
       (*int_vec)[i] = val;
   }
 
-  void hot_encoding_mask(CryptoContext<DCRTPoly> &bfv_ctx, vector<PT> &one_hot, vector<PT> &zero_hot, size_t batch_size)
+  inline size_t n_plaintexts(size_t batch_size) const
+  {
+    return (n / batch_size) + ((n % batch_size == 0) ? 0 : 1);
+  }
+
+  inline size_t n_ciphertexts(size_t batch_size) const
   {
-    vector<bool> filled = filled_slots();
+    return (ct_pt == nullptr) ? n_plaintexts(batch_size) : ct_pt->size();
+  }
+
+  // Plaintext of the map behind ciphertext k of M
+  inline size_t pt_of(size_t k) const
+  {
+    return (ct_pt == nullptr) ? k : (*ct_pt)[k];
+  }
+
+  // Plaintexts with at least one inserted slot, in order
+  vector<size_t> occupied_plaintexts(size_t batch_size) const
+  {
+    vector<size_t> pts;
+    for (size_t w = 0; w < data.used.size(); w++)
+    {
+      for (uint64_t bits = data.used[w]; bits != 0; bits &= bits - 1)
+      {
+        size_t i = ((w * 64) + (size_t)__builtin_ctzll(bits)) / batch_size;
+        if (pts.empty() || pts.back() != i)
+          pts.push_back(i);
+      }
+    }
+    return pts;
+  }
+
+  // zero_hot is left empty unless with_zero_hot
+  void hot_encoding_mask(CryptoContext<DCRTPoly> &bfv_ctx, vector<PT> &one_hot, vector<PT> &zero_hot, size_t batch_size, bool with_zero_hot = true)
+  {
+    hot_encoding_range(bfv_ctx, one_hot, zero_hot, batch_size, with_zero_hot, 0, n_ciphertexts(batch_size));
+  }
+
+  // hot_encoding_mask of ciphertexts [begin, end) of M only; one_hot[0] is
+  // for ciphertext begin
+  void hot_encoding_range(CryptoContext<DCRTPoly> &bfv_ctx, vector<PT> &one_hot, vector<PT> &zero_hot, size_t batch_size, bool with_zero_hot, size_t begin, size_t end)
+  {
+    TraceSpan span("hot_encoding");
     size_t ring_dim = bfv_ctx->GetRingDimension();
-    size_t num_pt = (n / batch_size) + ((n % batch_size == 0) ? 0 : 1);
 
-    one_hot.resize(num_pt);
-    zero_hot.resize(num_pt);
+    one_hot.resize(end - begin);
+    zero_hot.resize(with_zero_hot ? end - begin : 0);
 
     size_t n_cf_per_hash = sz * 8;
     if (pack_type == MULTIPLE_COMPACT)
       n_cf_per_hash = ring_dim / batch_size;
-    for (size_t i = 0; i < num_pt; i++)
+    for (size_t k = begin; k < end; k++)
     {
+      size_t i = pt_of(k);
       vector<int64_t> hot_vec(n_cf_per_hash * batch_size);
       for (size_t j = 0; j < batch_size; j++)
       {
         size_t start_idx = n_cf_per_hash * j;
-        if (filled[i * batch_size + j])
+        size_t idx = i * batch_size + j;
+        if (idx < n && data.is_used(idx))
           fill_int_arr(&hot_vec, 1, start_idx, n_cf_per_hash);
         else
           fill_int_arr(&hot_vec, 0, start_idx, n_cf_per_hash);
       }
-      one_hot[i] = bfv_ctx->MakePackedPlaintext(hot_vec);
+      one_hot[k - begin] = bfv_ctx->MakePackedPlaintext(hot_vec);
+      if (!with_zero_hot)
+        continue;
       for (size_t j = 0; j < n_cf_per_hash * batch_size; j++)
         hot_vec[j] = 1 - hot_vec[j];
-      zero_hot[i] = bfv_ctx->MakePackedPlaintext(hot_vec);
+      zero_hot[k - begin] = bfv_ctx->MakePackedPlaintext(hot_vec);
     }
   }
 
-  void serialize_data(CryptoContext<DCRTPoly> &ctx, vector<PT> &pt, bool ad, size_t batch_size, size_t num_threads)
+  void serialize_data(CryptoContext<DCRTPoly> &ctx, vector<PT> &pt, bool ad, size_t batch_size)
   {
-    size_t ring_dim = ctx->GetRingDimension();
-    size_t num_hashes_per_pt = batch_size;
+    cout << "# Plaintexts = " << n_ciphertexts(batch_size) << endl;
+    cout << "# Hashes / Plaintext = " << batch_size << endl;
+    serialize_range(ctx, pt, ad, batch_size, 0, n_ciphertexts(batch_size));
+  }
+
+  // serialize_data of ciphertexts [begin, end) of M only; pt[0] is for
+  // ciphertext begin
+  void serialize_range(CryptoContext<DCRTPoly> &ctx, vector<PT> &pt, bool ad, size_t batch_size, size_t begin, size_t end)
+  {
+    size_t num_hashes_per_pt = batch_size, last = n_plaintexts(batch_size) - 1;
+    pt.resize(end - begin);
     if (ad)
     {
-      size_t num_pt = (n / num_hashes_per_pt) + ((n % num_hashes_per_pt == 0) ? 0 : 1);
-      cout << "# Plaintexts = " << num_pt << endl;
-      cout << "# Hashes / Plaintext = " << num_hashes_per_pt << endl;
-      pt.resize(num_pt);
-      size_t count = num_hashes_per_pt;
-      vector<double> vec(count);
-      for (size_t i = 0; i < num_pt; i++)
-      {
-        if ((i == num_pt - 1) && (n % num_hashes_per_pt != 0))
-        {
-          count = (n % num_hashes_per_pt);
-          vec.resize(count);
-        }
-        for (size_t j = 0; j < count; j++)
-          vec[j] = (double)ad_data[j + (i * num_hashes_per_pt)];
-        pt[i] = ctx->MakeCKKSPackedPlaintext(vec);
-      }
+      parallel_for("encode_ad", *pool, end - begin, [this, &ctx, &pt, begin, last, num_hashes_per_pt](const size_t start, const size_t end)
+                     {
+                       vector<double> vec;
+                       for (size_t k = begin + start; k < begin + end; k++)
+                       {
+                         size_t i = pt_of(k), count = num_hashes_per_pt;
+                         if ((i == last) && (n % num_hashes_per_pt != 0))
+                           count = (n % num_hashes_per_pt);
+                         vec.resize(count);
+                         for (size_t j = 0; j < count; j++)
+                           vec[j] = (double)ad_data[j + (i * num_hashes_per_pt)];
+                         pt[k - begin] = ctx->MakeCKKSPackedPlaintext(vec);
+                       } });
       return;
     }
-    vector<vector<uint8_t>> *buf = &data;
-    size_t num_cf_per_hash = ring_dim / num_hashes_per_pt;
-    size_t num_pt = (n / num_hashes_per_pt) + ((n % num_hashes_per_pt == 0) ? 0 : 1);
-    pt.resize(num_pt);
 
-    cout << "# Plaintexts = " << num_pt << endl;
-    cout << "# Hashes / Plaintext = " << num_hashes_per_pt << endl;
-    size_t num_hashes = num_hashes_per_pt;
+    // One block of plaintexts per thread, each with its own coefficient scratch
+    parallel_for("pack", *pool, end - begin, [this, &ctx, &pt, batch_size, begin](const size_t start, const size_t end)
+                 {
+                   vector<int64_t> int_vec;
+                   for (size_t k = begin + start; k < begin + end; k++)
+                     pack_pt(ctx, data.slot(pt_of(k) * batch_size), pt_of(k), batch_size, &pt[k - begin], &int_vec); });
+  }
 
-    BS::thread_pool pool(1);
+  // Packs plaintext i, whose hashes start at hashes, with the map's packing type
+  void pack_pt(CryptoContext<DCRTPoly> &ctx, const uint8_t *hashes, size_t i, size_t batch_size, PT *pt, vector<int64_t> *int_vec)
+  {
+    size_t ring_dim = ctx->GetRingDimension();
+    size_t num_pt = (n / batch_size) + ((n % batch_size == 0) ? 0 : 1);
+    size_t num_hashes = batch_size;
+    if ((i == num_pt - 1) && (n % batch_size > 0))
+      num_hashes = n % batch_size;
 
     if (pack_type == SINGLE)
-    {
-      for (size_t i = 0; i < num_pt; i++)
-        pack_bitwise_single(ctx, &pt[i], &(*buf)[i]);
-    }
+      pack_bitwise_single(ctx, pt, hashes, sz, int_vec);
     else if (pack_type == MULTIPLE)
+      pack_bitwise_multiple(ctx, pt, hashes, num_hashes, sz * 8, (i == num_pt - 1), int_vec);
+    else if (pack_type == MULTIPLE_COMPACT)
+      pack_multiple_compact(ctx, pt, hashes, sz, num_hashes, ring_dim / batch_size, ring_dim, (i == num_pt - 1), int_vec);
+  }
+
+  // Packs the layer-th tag of every bin of plaintext i; bins with fewer tags
+  // get random filler. Layer 0 is data, so empty slots must be filled first.
+  void pack_layer_pt(CryptoContext<DCRTPoly> &ctx, size_t layer, size_t i, size_t batch_size, PT *pt, vector<int64_t> *int_vec)
+  {
+    if (layer == 0)
     {
-      for (size_t i = 0; i < num_pt; i++)
-      {
-        if ((i == num_pt - 1) && (n % num_hashes_per_pt > 0))
-          num_hashes = n % num_hashes_per_pt;
-        pack_bitwise_multiple(ctx, &pt[i], buf, i * num_hashes_per_pt, num_hashes, sz * 8, (i == num_pt - 1));
-      }
+      pack_pt(ctx, data.slot(i * batch_size), i, batch_size, pt, int_vec);
+      return;
     }
-    else if (pack_type == MULTIPLE_COMPACT)
+    size_t start = i * batch_size, end = min(n, (i + 1) * batch_size);
+    vector<uint8_t> hashes((end - start) * sz);
+    random_bytes(hashes.data(), hashes.size());
+    for (size_t j = start; j < end; j++)
     {
-      for (size_t i = 0; i < num_pt; i++)
-      {
-        if ((i == num_pt - 1) && (n % num_hashes_per_pt > 0))
-          num_hashes = n % num_hashes_per_pt;
-        pool.push_task(pack_multiple_compact, ctx, &pt[i], buf, i * num_hashes_per_pt, num_hashes, num_cf_per_hash, ring_dim, (i == num_pt - 1));
-      }
+      if (bin_load[j] > layer)
+        memcpy(hashes.data() + ((j - start) * sz), bin_tags.data() + ((bin_offset[j] + layer - 1) * sz), sz);
     }
-
-    pool.wait_for_tasks();
+    pack_pt(ctx, hashes.data(), i, batch_size, pt, int_vec);
   }
 
-  void serialize(CryptoContext<DCRTPoly> &bfv_ctx, CryptoContext<DCRTPoly> &ckks_ctx, vector<PT> &pt, vector<PT> &ad_pt, bool fill_random, size_t batch_size, size_t num_threads)
+  void serialize(CryptoContext<DCRTPoly> &bfv_ctx, CryptoContext<DCRTPoly> &ckks_ctx, vector<PT> &pt, vector<PT> &ad_pt, bool fill_random, size_t batch_size)
   {
     if (fill_random)
       fill_empty_random();
     else
       fill_empty_zeros();
 
-    serialize_data(bfv_ctx, pt, false, batch_size, num_threads);
+    serialize_data(bfv_ctx, pt, false, batch_size);
     if (ad_data.size() > 0)
-      serialize_data(ckks_ctx, ad_pt, true, batch_size, num_threads);
+      serialize_data(ckks_ctx, ad_pt, true, batch_size);
   }
 };
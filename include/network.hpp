@@ -0,0 +1,419 @@
+#pragma once
+
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "crypto.hpp"
+
+using namespace std;
+using namespace lbcrypto;
+
+/* -------------------------------------- */
+
+// A connected stream socket carrying length-prefixed frames
+struct Channel
+{
+  int fd = -1;
+  size_t sent = 0, recvd = 0;
+
+  void send_all(const void *buf, size_t len)
+  {
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0)
+    {
+      ssize_t r = ::send(fd, p, len, MSG_NOSIGNAL);
+      if (r <= 0)
+      {
+        if (r < 0 && errno == EINTR)
+          continue;
+        throw runtime_error("Channel send failed.");
+      }
+      p += r;
+      len -= (size_t)r;
+      sent += (size_t)r;
+    }
+  }
+
+  void recv_all(void *buf, size_t len)
+  {
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0)
+    {
+      ssize_t r = ::recv(fd, p, len, 0);
+      if (r <= 0)
+      {
+        if (r < 0 && errno == EINTR)
+          continue;
+        throw runtime_error("Channel closed.");
+      }
+      p += r;
+      len -= (size_t)r;
+      recvd += (size_t)r;
+    }
+  }
+
+  void send_frame(const string &buf)
+  {
+    uint64_t len = buf.size();
+    send_all(&len, sizeof(len));
+    send_all(buf.data(), buf.size());
+  }
+
+  string recv_frame()
+  {
+    uint64_t len;
+    recv_all(&len, sizeof(len));
+    string buf(len, '\0');
+    recv_all(buf.data(), len);
+    return buf;
+  }
+
+  template <typename T>
+  void send_pod(const T &x)
+  {
+    send_all(&x, sizeof(T));
+  }
+
+  template <typename T>
+  T recv_pod()
+  {
+    T x;
+    recv_all(&x, sizeof(T));
+    return x;
+  }
+
+  // A vector of PODs as its length and its bytes
+  template <typename T>
+  void send_pods(const vector<T> &v)
+  {
+    send_pod<uint64_t>(v.size());
+    send_all(v.data(), v.size() * sizeof(T));
+  }
+
+  template <typename T>
+  void recv_pods(vector<T> &v)
+  {
+    v.resize(recv_pod<uint64_t>());
+    recv_all(v.data(), v.size() * sizeof(T));
+  }
+};
+
+/*
+  Full mesh between the n parties of one run. addr is either
+  "unix:<prefix>", where party i listens on <prefix>.<i>.sock, or
+  "tcp:<host>:<port>", where party i listens on port + i. Party i connects
+  to every party below it and accepts the parties above it.
+*/
+struct Network
+{
+  static const int CONNECT_TIMEOUT_MS = 30000;
+
+  size_t id, n;
+  string addr;
+  vector<Channel> peers;
+  int listen_fd = -1;
+  bool is_unix;
+
+  string phase, phase_key;
+  size_t phase_sent = 0, phase_recvd = 0;
+  Stopwatch phase_sw;
+  // When set, phases begun with a key add <key>_s, <key>_sent_mb and
+  // <key>_recvd_mb to it
+  RunReport *report = nullptr;
+
+  Network(size_t party_id, size_t num_parties, const string &address) : id(party_id), n(num_parties), addr(address), peers(num_parties)
+  {
+    is_unix = (addr.rfind("unix:", 0) == 0);
+    if (!is_unix && addr.rfind("tcp:", 0) != 0)
+      throw runtime_error("Unknown address " + addr + ".");
+
+    listen_fd = open_listener(id);
+    for (size_t j = 0; j < id; j++)
+    {
+      peers[j].fd = connect_to(j);
+      uint32_t me = (uint32_t)id;
+      peers[j].send_all(&me, sizeof(me));
+    }
+    for (size_t k = id + 1; k < n; k++)
+    {
+      int fd = ::accept(listen_fd, nullptr, nullptr);
+      if (fd < 0)
+        throw runtime_error("Accept failed.");
+      tune(fd);
+      Channel ch;
+      ch.fd = fd;
+      uint32_t j = ch.recv_pod<uint32_t>();
+      assert(j > id && j < n);
+      peers[j].fd = fd;
+    }
+    ::close(listen_fd);
+    if (is_unix)
+      ::unlink(unix_path(id).c_str());
+    listen_fd = -1;
+    for (auto &p : peers)
+      p.sent = p.recvd = 0;
+  }
+
+  ~Network()
+  {
+    for (auto &p : peers)
+    {
+      if (p.fd >= 0)
+        ::close(p.fd);
+    }
+  }
+
+  Network(const Network &) = delete;
+  Network &operator=(const Network &) = delete;
+
+  Channel &peer(size_t j)
+  {
+    assert(j != id && j < n);
+    return peers[j];
+  }
+
+  /* -------------------------------------- */
+
+  string unix_path(size_t j)
+  {
+    return addr.substr(5) + "." + to_string(j) + ".sock";
+  }
+
+  void tcp_addr(size_t j, sockaddr_in &sa)
+  {
+    string rest = addr.substr(4);
+    size_t colon = rest.rfind(':');
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)(stoi(rest.substr(colon + 1)) + (int)j));
+    if (inet_pton(AF_INET, rest.substr(0, colon).c_str(), &sa.sin_addr) != 1)
+      throw runtime_error("Bad address " + addr + ".");
+  }
+
+  void tune(int fd)
+  {
+    int buf_sz = 1 << 22;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_sz, sizeof(buf_sz));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_sz, sizeof(buf_sz));
+    if (!is_unix)
+    {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+  }
+
+  int open_listener(size_t j)
+  {
+    int fd;
+    if (is_unix)
+    {
+      sockaddr_un sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sun_family = AF_UNIX;
+      string path = unix_path(j);
+      assert(path.size() < sizeof(sa.sun_path));
+      strcpy(sa.sun_path, path.c_str());
+      ::unlink(path.c_str());
+      fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0 || ::bind(fd, (sockaddr *)&sa, sizeof(sa)) != 0)
+        throw runtime_error("Cannot bind " + path + ".");
+    }
+    else
+    {
+      sockaddr_in sa;
+      tcp_addr(j, sa);
+      fd = ::socket(AF_INET, SOCK_STREAM, 0);
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (fd < 0 || ::bind(fd, (sockaddr *)&sa, sizeof(sa)) != 0)
+        throw runtime_error("Cannot bind port " + to_string(ntohs(sa.sin_port)) + ".");
+    }
+    if (::listen(fd, (int)n) != 0)
+      throw runtime_error("Listen failed.");
+    return fd;
+  }
+
+  // Retries until party j is listening
+  int connect_to(size_t j)
+  {
+    for (int waited = 0; waited < CONNECT_TIMEOUT_MS; waited += 10)
+    {
+      int fd, ok;
+      if (is_unix)
+      {
+        sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, unix_path(j).c_str());
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        ok = ::connect(fd, (sockaddr *)&sa, sizeof(sa));
+      }
+      else
+      {
+        sockaddr_in sa;
+        tcp_addr(j, sa);
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        ok = ::connect(fd, (sockaddr *)&sa, sizeof(sa));
+      }
+      if (ok == 0)
+      {
+        tune(fd);
+        return fd;
+      }
+      ::close(fd);
+      this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    throw runtime_error("Cannot reach party " + to_string(j) + ".");
+  }
+
+  /* -------------------------------------- */
+
+  size_t total_sent()
+  {
+    size_t s = 0;
+    for (auto &p : peers)
+      s += p.sent;
+    return s;
+  }
+
+  size_t total_recvd()
+  {
+    size_t s = 0;
+    for (auto &p : peers)
+      s += p.recvd;
+    return s;
+  }
+
+  // Starts attributing traffic to name; reports the previous phase, if any
+  void begin_phase(const string &name, const string &key = "")
+  {
+    end_phase();
+    phase = name;
+    phase_key = key;
+    phase_sent = total_sent();
+    phase_recvd = total_recvd();
+    phase_sw.start();
+  }
+
+  void end_phase()
+  {
+    if (phase.empty())
+      return;
+    double sent_mb = (double)(total_sent() - phase_sent) / (1 << 20);
+    double recvd_mb = (double)(total_recvd() - phase_recvd) / (1 << 20);
+    printf("Comm [%s]: sent %.2f MB, received %.2f MB\n", phase.c_str(), sent_mb, recvd_mb);
+    if (report != nullptr && !phase_key.empty())
+    {
+      report->add(phase_key + "_s", phase_sw.elapsed());
+      report->add(phase_key + "_sent_mb", sent_mb);
+      report->add(phase_key + "_recvd_mb", recvd_mb);
+    }
+    phase.clear();
+  }
+};
+
+/* -------------------------------------- */
+
+template <typename T>
+void send_obj(Channel &ch, const T &obj)
+{
+  stringstream ss;
+  Serial::Serialize(obj, ss, SerType::BINARY);
+  ch.send_frame(ss.str());
+}
+
+template <typename T>
+void recv_obj(Channel &ch, T &obj)
+{
+  stringstream ss(ch.recv_frame());
+  Serial::Deserialize(obj, ss, SerType::BINARY);
+}
+
+/*
+  Streams A as a count followed by one frame per ciphertext. The pool
+  serializes the next batch while the current one is on the wire.
+*/
+inline void send_cts(Channel &ch, const vector<CT> &A, BS::thread_pool &pool)
+{
+  TraceSpan span("send");
+  ch.send_pod<uint64_t>(A.size());
+  size_t batch = max((size_t)pool.get_thread_count() * 4, (size_t)1);
+  vector<string> cur, next;
+  auto serialize = [&A, &pool, batch](size_t begin, vector<string> &out)
+  {
+    size_t end = min(begin + batch, A.size());
+    out.assign(end - begin, string());
+    return pool.parallelize_loop(end - begin, [&A, &out, begin](const size_t start, const size_t end)
+                                 {
+                                   for (size_t i = start; i < end; i++)
+                                   {
+                                     stringstream ss;
+                                     Serial::Serialize(A[begin + i], ss, SerType::BINARY);
+                                     out[i] = ss.str();
+                                   } });
+  };
+
+  if (A.empty())
+    return;
+  serialize(0, cur).get();
+  for (size_t begin = 0; begin < A.size(); begin += batch)
+  {
+    BS::multi_future<void> pending;
+    bool more = begin + batch < A.size();
+    if (more)
+      pending = serialize(begin + batch, next);
+    for (const auto &buf : cur)
+      ch.send_frame(buf);
+    if (more)
+    {
+      pending.get();
+      swap(cur, next);
+    }
+  }
+}
+
+// Receives what send_cts sent, deserializing each batch on the pool while
+// the next one is read
+inline void recv_cts(Channel &ch, vector<CT> &A, BS::thread_pool &pool)
+{
+  TraceSpan span("recv");
+  A.resize(ch.recv_pod<uint64_t>());
+  size_t batch = max((size_t)pool.get_thread_count() * 4, (size_t)1);
+  vector<string> cur(batch);
+  BS::multi_future<void> pending;
+  vector<string> in_flight;
+  for (size_t begin = 0; begin < A.size(); begin += batch)
+  {
+    size_t end = min(begin + batch, A.size());
+    cur.resize(end - begin);
+    for (size_t i = 0; i < end - begin; i++)
+      cur[i] = ch.recv_frame();
+    pending.get();
+    swap(cur, in_flight);
+    pending = pool.parallelize_loop(end - begin, [&A, &in_flight, begin](const size_t start, const size_t end)
+                                    {
+                                      for (size_t i = start; i < end; i++)
+                                      {
+                                        stringstream ss(in_flight[i]);
+                                        Serial::Deserialize(A[begin + i], ss, SerType::BINARY);
+                                      } });
+  }
+  pending.get();
+}
+
+inline void send_mult_keys(Channel &ch, const CryptoContext<DCRTPoly> &ctx)
+{
+  stringstream ss;
+  ctx->SerializeEvalMultKey(ss, SerType::BINARY);
+  ch.send_frame(ss.str());
+}
+
+inline void recv_mult_keys(Channel &ch, const CryptoContext<DCRTPoly> &ctx)
+{
+  stringstream ss(ch.recv_frame());
+  ctx->DeserializeEvalMultKey(ss, SerType::BINARY);
+}
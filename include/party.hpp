@@ -1,7 +1,10 @@
 #pragma once
 
 #include <bitset>
+#include <mutex>
+#include <condition_variable>
 #include "crypto.hpp"
+#include "ctstore.hpp"
 
 using namespace std;
 using namespace lbcrypto;
@@ -16,8 +19,7 @@ inline void encrypt_single(const CryptoContext<DCRTPoly> &ctx, const PK &pk, PT
 
 inline void encrypt_zero_single(const CryptoContext<DCRTPoly> &bfv_ctx, const PK &pk, CT *ct)
 {
-  PT pt;
-  bfv_ctx->MakePackedPlaintext({0});
+  PT pt = bfv_ctx->MakePackedPlaintext({0});
   *ct = bfv_ctx->Encrypt(pk, pt);
 }
 
@@ -31,6 +33,67 @@ inline void multiply_single(const CryptoContext<DCRTPoly> &bfv_ctx, const CT *a,
   *res = bfv_ctx->EvalMult(*b, *a);
 }
 
+// res = prod_b (a - layer b of hm's bins) over the layers plaintext i occupies;
+// zero exactly where some tag in the bin matches
+inline void bin_diff_single(const CryptoContext<DCRTPoly> &bfv_ctx, HashMap *hm, const CT *a, size_t i, size_t batch_size, CT *res)
+{
+  CryptoContext<DCRTPoly> ctx = bfv_ctx;
+  size_t n_layers = hm->pt_max_load(i, batch_size);
+  vector<CT> diffs(n_layers);
+  vector<int64_t> int_vec;
+  for (size_t b = 0; b < n_layers; b++)
+  {
+    PT pt;
+    hm->pack_layer_pt(ctx, b, i, batch_size, &pt, &int_vec);
+    diffs[b] = bfv_ctx->EvalSub(*a, pt);
+  }
+  for (size_t step = 1; step < n_layers; step *= 2)
+  {
+    for (size_t b = 0; b + step < n_layers; b += 2 * step)
+      diffs[b] = bfv_ctx->EvalMult(diffs[b], diffs[b + step]);
+  }
+  *res = diffs[0];
+}
+
+// c = d, or d * one_hot when one_hot is set, where d = a - hm_pt, or the bin
+// product of hm when hm_pt is null (cuckoo)
+inline void share_single(const CryptoContext<DCRTPoly> &bfv_ctx, HashMap *hm, const CT *a, const PT *hm_pt, const PT *one_hot, size_t i, size_t batch_size, CT *c)
+{
+  CT diff;
+  if (hm_pt != nullptr)
+    diff = bfv_ctx->EvalSub(*a, *hm_pt);
+  else
+    bin_diff_single(bfv_ctx, hm, a, i, batch_size, &diff);
+  *c = (one_hot == nullptr) ? diff : bfv_ctx->EvalMult(*one_hot, diff);
+}
+
+// r = r * zero_hot + c, or r + c when zero_hot is null
+inline void fold_single(const CryptoContext<DCRTPoly> &bfv_ctx, const CT *c, const PT *zero_hot, CT *r)
+{
+  if (zero_hot != nullptr)
+    *r = bfv_ctx->EvalMult(*zero_hot, *r);
+  bfv_ctx->EvalAddInPlace(*r, *c);
+}
+
+/*
+  One provider's update of R[i], with all intermediates local to the call:
+    first provider   r = d
+    MPSI             r = r + d * one_hot
+    MPSIU            r = r * zero_hot + d * one_hot
+  one_hot is null for the first provider, zero_hot is null unless MPSIU.
+*/
+inline void update_r_single(const CryptoContext<DCRTPoly> &bfv_ctx, HashMap *hm, const CT *a, const PT *hm_pt, const PT *one_hot, const PT *zero_hot, size_t i, size_t batch_size, CT *r)
+{
+  if (one_hot == nullptr)
+  {
+    share_single(bfv_ctx, hm, a, hm_pt, nullptr, i, batch_size, r);
+    return;
+  }
+  CT c;
+  share_single(bfv_ctx, hm, a, hm_pt, one_hot, i, batch_size, &c);
+  fold_single(bfv_ctx, &c, zero_hot, r);
+}
+
 inline void add_single_ct_inplace(const CryptoContext<DCRTPoly> &bfv_ctx, CT *a, const CT *b)
 {
   bfv_ctx->EvalAddInPlace(*a, *b);
@@ -45,9 +108,7 @@ inline void add_single_pt_inplace(const CryptoContext<DCRTPoly> &bfv_ctx, CT *a,
 inline void randomize_single_inplace(const CryptoContext<DCRTPoly> &bfv_ctx, const CryptoContext<DCRTPoly> &ckks_ctx, CT *a, CT *b, size_t plain_mod, size_t ring_dim, size_t num_cf_per_hash)
 {
   vector<int64_t> int_vec(ring_dim);
-
-  for (size_t i = 0; i < ring_dim; i++)
-    int_vec[i] = random_int(plain_mod);
+  random_ints(int_vec, plain_mod);
 
   PT pt = bfv_ctx->MakePackedPlaintext(int_vec);
   CT res;
@@ -68,33 +129,55 @@ inline void randomize_single_inplace(const CryptoContext<DCRTPoly> &bfv_ctx, con
   // }
 }
 
-inline void decrypt_check_one(const CryptoContext<DCRTPoly> &bfv_ctx, const SK &sk, const CT *ct, size_t nbits, PackingType pack_type, vector<bool> *ret, size_t batch_size)
+// Decrypts ct and sets bit j of row iff hash j of the plaintext is all zero,
+// reading the decoded coefficients in place
+inline void decrypt_check_one(const CryptoContext<DCRTPoly> &bfv_ctx, const SK &sk, const CT *ct, size_t nbits, PackingType pack_type, uint64_t *row, size_t batch_size)
 {
   PT pt;
   bfv_ctx->Decrypt(sk, *ct, &pt);
+  const vector<int64_t> &cf = pt->GetPackedValue();
 
   if (pack_type == SINGLE)
-  {
-    ret->resize(1);
-    vector<uint8_t> unpacked;
-    unpack_bitwise_single(pt, &unpacked, nbits);
-    (*ret)[0] = is_zero(&unpacked);
-    return;
-  }
-
-  vector<vector<uint8_t>> unpacked;
-  if (pack_type == MULTIPLE)
-    unpack_bitwise_multiple(pt, &unpacked, batch_size, nbits);
+    zero_runs(cf.data(), 1, nbits, nbits, row);
+  else if (pack_type == MULTIPLE)
+    zero_runs(cf.data(), batch_size, nbits, nbits, row);
   else if (pack_type == MULTIPLE_COMPACT)
-    unpack_multiple_compact(pt, &unpacked, bits_to_bytes(nbits));
-
-  ret->resize(batch_size);
-  for (size_t i = 0; i < batch_size; i++)
-    (*ret)[i] = is_zero(&unpacked[i]);
+    zero_runs(cf.data(), batch_size, bfv_ctx->GetRingDimension() / batch_size, compact_cf_count(nbits, plain_mod_bits(bfv_ctx->GetCryptoParameters()->GetPlaintextModulus())), row);
 }
 
 /* -------------------------------------- */
 
+// A provider's contribution to R, computed independently of R
+struct Share
+{
+  vector<CT> ct;
+  vector<PT> zero_hot;
+};
+
+// Number of leading chunks of R a pipeline stage has finished
+struct ChunkProgress
+{
+  mutex mtx;
+  condition_variable cv;
+  size_t done = 0;
+
+  void publish(size_t n_chunks)
+  {
+    {
+      lock_guard<mutex> lock(mtx);
+      done = n_chunks;
+    }
+    cv.notify_all();
+  }
+
+  void wait_for(size_t n_chunks)
+  {
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this, n_chunks]
+            { return done >= n_chunks; });
+  }
+};
+
 struct Party
 {
   shared_ptr<CCParams<CryptoContextBFVRNS>> bfv_parms;
@@ -111,8 +194,9 @@ struct Party
     pro_parms = pp;
     bfv_parms = bfv_p;
     ckks_parms = ckks_p;
-    bfv_ctx = gen_crypto_ctx(bfv_parms);
-    ckks_ctx = gen_crypto_ctx(ckks_p);
+    bfv_ctx = cached_crypto_ctx(bfv_parms);
+    ckks_ctx = cached_crypto_ctx(ckks_p);
+    ensure_pool(pro_parms);
 
     // if (pro_parms.party_id == pro_parms.num_parties - 1)
     //   bfv_ctx->InsertEvalAutomorphismKey(pro_parms.ek);
@@ -122,42 +206,100 @@ struct Party
 
   size_t decrypt_check_all(const SK &bfv_sk, const Tuple<vector<CT>> *B, CT &result)
   {
-    BS::thread_pool pool(pro_parms.num_threads);
-    vector<vector<bool>> ret(B->e0.size());
+    size_t row_sz = (pro_parms.pack_type == SINGLE) ? 1 : pro_parms.batch_size;
+    ZeroBitmap matches(B->e0.size(), row_sz);
+    vector<CT> partials;
+    decrypt_check_range(bfv_sk, B->e0, pro_parms.with_ad ? &B->e1 : nullptr, 0, matches, partials);
+    if (!partials.empty())
+      result = ckks_ctx->EvalSum(sum_tree(partials), pro_parms.batch_size);
+    return matches.count();
+  }
+
+  /*
+    Decrypts and checks e0[i] into row off + i of matches. With e1, each pool
+    block weights e1[i] by that row as soon as it is set and adds it to a
+    partial sum of its own, so the CKKS work of one block overlaps the BFV
+    decryptions of the others; the block sums are appended to partials.
+  */
+  void decrypt_check_range(const SK &bfv_sk, const vector<CT> &e0, const vector<CT> *e1, size_t off, ZeroBitmap &matches, vector<CT> &partials)
+  {
     size_t nbits = pro_parms.hash_sz * 8;
-    size_t count = 0;
-    for (size_t i = 0; i < B->e0.size(); i++)
-      pool.push_task(decrypt_check_one, bfv_ctx, bfv_sk, &(B->e0[i]), nbits, pro_parms.pack_type, &ret[i], pro_parms.batch_size);
-    pool.wait_for_tasks();
-    vector<bool> one_hot_matches(ret.size() * ret[0].size());
-    for (size_t i = 0; i < ret.size(); i++)
+    mutex mtx;
+    parallel_for("decrypt_check", *pro_parms.pool, e0.size(), [this, &bfv_sk, &e0, e1, off, &matches, &partials, &mtx, nbits](const size_t start, const size_t end)
+                 {
+                   CT sum;
+                   for (size_t i = start; i < end; i++)
+                   {
+                     decrypt_check_one(bfv_ctx, bfv_sk, &e0[i], nbits, pro_parms.pack_type, matches.row(off + i), pro_parms.batch_size);
+                     if (e1 == nullptr)
+                       continue;
+                     TraceSpan span("ckks_sum");
+                     CT w = weighted_single(matches, off + i, (*e1)[i]);
+                     if (i == start)
+                       sum = w;
+                     else
+                       ckks_ctx->EvalAddInPlace(sum, w);
+                   }
+                   if (e1 != nullptr)
+                   {
+                     lock_guard<mutex> lock(mtx);
+                     partials.push_back(sum);
+                   } });
+  }
+
+  // e1 weighted by row i of matches: slot j is kept iff hash j matched
+  CT weighted_single(const ZeroBitmap &matches, size_t i, const CT &e1)
+  {
+    vector<double> vec(pro_parms.batch_size, 0);
+    for (size_t j = 0; j < min(matches.row_bits, pro_parms.batch_size); j++)
+      vec[j] = (double)matches.test(i, j);
+    PT pt = ckks_ctx->MakeCKKSPackedPlaintext(vec);
+    return ckks_ctx->EvalMult(pt, e1);
+  }
+
+  // Adds up parts pairwise, one tree level at a time on the pool; parts must
+  // not be empty and is overwritten
+  CT sum_tree(vector<CT> &parts)
+  {
+    assert(!parts.empty());
+    for (size_t step = 1; step < parts.size(); step *= 2)
     {
-      for (size_t j = 0; j < ret[i].size(); j++)
-      {
-        count += (size_t)ret[i][j];
-        one_hot_matches[(i * ret[i].size()) + j] = ret[i][j];
-      }
+      size_t n_pairs = (parts.size() + (2 * step) - 1) / (2 * step);
+      parallel_for("ckks_combine", *pro_parms.pool, n_pairs, [this, &parts, step](const size_t start, const size_t end)
+                   {
+                     for (size_t p = start; p < end; p++)
+                     {
+                       size_t a = p * 2 * step;
+                       if (a + step < parts.size())
+                         ckks_ctx->EvalAddInPlace(parts[a], parts[a + step]);
+                     } });
     }
-    if (pro_parms.with_ad)
-    {
-      one_hot_matches.resize(pro_parms.batch_size * B->e1.size());
-      CT res;
-      PT res_pt;
-      for (size_t i = 0; i < B->e1.size(); i++)
-      {
-        size_t start = i * pro_parms.batch_size;
-        vector<double> vec(pro_parms.batch_size, 0);
-        for (size_t j = 0; j < pro_parms.batch_size; j++)
-          vec[j] = ((double)one_hot_matches[j + start]);
-        PT pt = ckks_ctx->MakeCKKSPackedPlaintext(vec);
-        if (i == 0)
-          result = ckks_ctx->EvalMult(pt, B->e1[i]);
-        else
-          ckks_ctx->EvalAddInPlace(result, ckks_ctx->EvalMult(pt, B->e1[i]));
-      }
+    return parts[0];
+  }
+
+  // decrypt_check_all over ciphertexts kept on disk, one segment at a time;
+  // each segment's partial sums are folded into result before the next
+  size_t decrypt_check_store(const SK &bfv_sk, const Tuple<CtStore> &B, CT &result)
+  {
+    size_t row_sz = (pro_parms.pack_type == SINGLE) ? 1 : pro_parms.batch_size;
+    ZeroBitmap matches(B.e0.count, row_sz);
+    vector<const CtStore *> ins = {&B.e0, pro_parms.with_ad ? &B.e1 : nullptr};
+    bool started = false;
+    stream_segments(ins, {nullptr, nullptr}, *pro_parms.pool, [this, &bfv_sk, &B, &matches, &result, &started](size_t k, vector<vector<CT>> &io)
+                    {
+                      vector<CT> partials;
+                      decrypt_check_range(bfv_sk, io[0], pro_parms.with_ad ? &io[1] : nullptr, B.e0.seg_begin(k), matches, partials);
+                      if (partials.empty())
+                        return;
+                      CT seg_sum = sum_tree(partials);
+                      if (started)
+                        ckks_ctx->EvalAddInPlace(result, seg_sum);
+                      else
+                        result = seg_sum;
+                      started = true; });
+    if (started)
       result = ckks_ctx->EvalSum(result, pro_parms.batch_size);
-    }
-    return count;
+    return matches.count();
   }
 
   void encrypt_all(const CryptoContext<DCRTPoly> &ctx, PK &pk, vector<CT> &M, vector<PT> &pt)
@@ -165,73 +307,133 @@ struct Party
     // Stopwatch sw;
     // sw.start();
     M.resize(pt.size());
-    thread_pool pool(pro_parms.num_threads);
-    for (size_t i = 0; i < M.size(); i++)
-      pool.push_task(encrypt_single, ctx, pk, &pt[i], &M[i]);
-    pool.wait_for_tasks();
+    parallel_for("encrypt", *pro_parms.pool, M.size(), [&ctx, &pk, &M, &pt](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                     encrypt_single(ctx, pk, &pt[i], &M[i]); });
     // printf("encrypted %lu plaintexts (took %5.2fs).", pt.size(), sw.elapsed());
   }
 
+  // Online encryption: M[i] = zeros[i] + pt[i] while precomputed encryptions
+  // of zero last, full encryption for the rest
+  void encrypt_all_from_zeros(const CryptoContext<DCRTPoly> &ctx, PK &pk, const vector<CT> &zeros, vector<CT> &M, vector<PT> &pt)
+  {
+    M.resize(pt.size());
+    parallel_for("encrypt_online", *pro_parms.pool, M.size(), [&ctx, &pk, &zeros, &M, &pt](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                   {
+                     if (i < zeros.size())
+                       M[i] = ctx->EvalAdd(zeros[i], pt[i]);
+                     else
+                       encrypt_single(ctx, pk, &pt[i], &M[i]);
+                   } });
+  }
+
   void add_all_inplace(vector<CT> &A, const vector<CT> &B)
   {
     assert(A.size() == B.size());
-    thread_pool pool(pro_parms.num_threads);
-    for (size_t i = 0; i < A.size(); i++)
-      pool.push_task(add_single_ct_inplace, bfv_ctx, &A[i], &B[i]);
-    pool.wait_for_tasks();
+    parallel_for("add", *pro_parms.pool, A.size(), [this, &A, &B](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                     add_single_ct_inplace(bfv_ctx, &A[i], &B[i]); });
   }
 
   void multiply_all(const vector<CT> &A, const vector<PT> &B, vector<CT> &dest)
   {
     assert(A.size() == B.size());
-    thread_pool pool(pro_parms.num_threads);
-    for (size_t i = 0; i < A.size(); i++)
-      pool.push_task(multiply_single, bfv_ctx, &A[i], &B[i], &dest[i]);
-    pool.wait_for_tasks();
+    parallel_for("multiply", *pro_parms.pool, A.size(), [this, &A, &B, &dest](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                     multiply_single(bfv_ctx, &A[i], &B[i], &dest[i]); });
   }
 
   void subtract_all(const vector<CT> &A, const vector<PT> &B, vector<CT> &dest)
   {
     assert(A.size() == B.size());
-    thread_pool pool(pro_parms.num_threads);
-    for (size_t i = 0; i < A.size(); i++)
-      pool.push_task(subtract_single, bfv_ctx, &A[i], &B[i], &dest[i]);
-    pool.wait_for_tasks();
+    parallel_for("subtract", *pro_parms.pool, A.size(), [this, &A, &B, &dest](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                     subtract_single(bfv_ctx, &A[i], &B[i], &dest[i]); });
   }
 
-  void randomize_all_inplace(Tuple<vector<CT>> *B)
+  // Runs update_r_single over every ciphertext; empty plaintext vectors are
+  // passed to the kernel as null
+  void update_r_all(const vector<CT> &A, HashMap &hm, const vector<PT> &hm_pt, const vector<PT> &one_hot, const vector<PT> &zero_hot, vector<CT> &R)
   {
-    Stopwatch sw;
-    sw.start();
+    update_r_range(A, hm, hm_pt, one_hot, zero_hot, R, 0, A.size());
+  }
+
+  // update_r_all restricted to ciphertexts [begin, end); the plaintexts of
+  // ciphertext i are at index i - pt_off, and it is A[i - ct_off], R[i - ct_off]
+  void update_r_range(const vector<CT> &A, HashMap &hm, const vector<PT> &hm_pt, const vector<PT> &one_hot, const vector<PT> &zero_hot, vector<CT> &R, size_t begin, size_t end, size_t pt_off = 0, size_t ct_off = 0)
+  {
+    assert(A.size() == R.size() && end - ct_off <= A.size());
+    // Bin products vary in depth per ciphertext, so use smaller blocks
+    parallel_for(
+        "update_r", *pro_parms.pool, end - begin, [this, &A, &hm, &hm_pt, &one_hot, &zero_hot, &R, begin, pt_off, ct_off](const size_t start, const size_t end)
+        {
+          for (size_t i = begin + start; i < begin + end; i++)
+          {
+            const PT *b = hm_pt.empty() ? nullptr : &hm_pt[i - pt_off];
+            const PT *one = one_hot.empty() ? nullptr : &one_hot[i - pt_off];
+            const PT *zero = zero_hot.empty() ? nullptr : &zero_hot[i - pt_off];
+            update_r_single(bfv_ctx, &hm, &A[i - ct_off], b, one, zero, hm.pt_of(i), pro_parms.batch_size, &R[i - ct_off]);
+          } },
+        4);
+  }
 
-    thread_pool pool(pro_parms.num_threads);
+  // Computes every share_single of this provider into C
+  void share_all(const vector<CT> &A, HashMap &hm, const vector<PT> &hm_pt, const vector<PT> &one_hot, vector<CT> &C)
+  {
+    C.resize(A.size());
+    parallel_for(
+        "share", *pro_parms.pool, A.size(), [this, &A, &hm, &hm_pt, &one_hot, &C](const size_t start, const size_t end)
+        {
+          for (size_t i = start; i < end; i++)
+          {
+            const PT *b = hm_pt.empty() ? nullptr : &hm_pt[i];
+            const PT *one = one_hot.empty() ? nullptr : &one_hot[i];
+            share_single(bfv_ctx, &hm, &A[i], b, one, hm.pt_of(i), pro_parms.batch_size, &C[i]);
+          } },
+        4);
+  }
+
+  // Randomizes B[begin, end) in place, without permuting
+  void randomize_block(Tuple<vector<CT>> *B, size_t begin, size_t end)
+  {
     size_t plain_mod = bfv_ctx->GetCryptoParameters()->GetPlaintextModulus();
     size_t ring_dim = bfv_ctx->GetRingDimension();
     size_t num_cf_per_hash = ring_dim / pro_parms.batch_size;
-    size_t b_size = B->e0.size();
+    for (size_t i = begin; i < end; i++)
+      randomize_single_inplace(bfv_ctx, ckks_ctx, &(B->e0[i]), pro_parms.with_ad ? &(B->e1[i]) : nullptr, plain_mod, ring_dim, num_cf_per_hash);
+  }
 
-    if (pro_parms.with_ad)
-    {
-      for (size_t i = 0; i < b_size; i++)
-        pool.push_task(randomize_single_inplace, bfv_ctx, ckks_ctx, &(B->e0[i]), &(B->e1[i]), plain_mod, ring_dim, num_cf_per_hash);
-    }
-    else
-    {
-      for (size_t i = 0; i < b_size; i++)
-        pool.push_task(randomize_single_inplace, bfv_ctx, ckks_ctx, &(B->e0[i]), nullptr, plain_mod, ring_dim, num_cf_per_hash);
-    }
+  void randomize_range(Tuple<vector<CT>> *B, size_t begin, size_t end)
+  {
+    parallel_for("randomize", *pro_parms.pool, end - begin, [this, B, begin](const size_t start, const size_t end)
+                 { randomize_block(B, begin + start, begin + end); });
+  }
 
-    vector<size_t> idx_vec(b_size);
-    for (size_t i = 0; i < b_size; i++)
+  static vector<size_t> draw_permutation(size_t n)
+  {
+    TraceSpan span("shuffle");
+    vector<size_t> idx_vec(n);
+    for (size_t i = 0; i < n; i++)
       idx_vec[i] = i;
 
     random_device rd;
     mt19937 gen(rd());
     shuffle(idx_vec.begin(), idx_vec.end(), gen);
+    return idx_vec;
+  }
 
+  void apply_permutation(Tuple<vector<CT>> *B, const vector<size_t> &idx_vec)
+  {
+    TraceSpan span("permute");
     if (pro_parms.with_ad)
     {
-      for (size_t i = 0; i < b_size; i++)
+      for (size_t i = 0; i < idx_vec.size(); i++)
       {
         swap(B->e0[i], B->e0[idx_vec[i]]);
         swap(B->e1[i], B->e1[idx_vec[i]]);
@@ -239,11 +441,31 @@ struct Party
     }
     else
     {
-      for (size_t i = 0; i < b_size; i++)
+      for (size_t i = 0; i < idx_vec.size(); i++)
         swap(B->e0[i], B->e0[idx_vec[i]]);
     }
+  }
+
+  void randomize_all_inplace(Tuple<vector<CT>> *B)
+  {
+    Stopwatch sw;
+    sw.start();
+
+    size_t b_size = B->e0.size();
+    uint32_t trace_party = Tracer::party();
+
+    // Draw the permutation while the pool randomizes; apply it once they finish
+    BS::multi_future<void> randomized = pro_parms.pool->parallelize_loop(
+        b_size, [this, B, trace_party](const size_t start, const size_t end)
+        {
+          TraceSpan span("randomize", trace_party);
+          randomize_block(B, start, end); },
+        pro_parms.pool->get_thread_count());
+
+    vector<size_t> idx_vec = draw_permutation(b_size);
+    randomized.wait();
+    apply_permutation(B, idx_vec);
 
-    pool.wait_for_tasks();
     printf("\nRandomization: %5.2fs\n", sw.elapsed());
   }
 
@@ -251,6 +473,7 @@ struct Party
 
   vector<CT> joint_decrypt(vector<CT> &agg_res)
   {
+    TraceSpan span("joint_decrypt", pro_parms.party_id);
     if (pro_parms.party_id == 0)
       return ckks_ctx->MultipartyDecryptLead(agg_res, sk_i);
     else
@@ -263,6 +486,7 @@ struct Party
   */
   void dkg(PK &apk, shared_ptr<EvalKeys> &ask)
   {
+    TraceSpan span("dkg", pro_parms.party_id);
     KeyPair<DCRTPoly> kp;
     if (pro_parms.party_id == 0)
     {
@@ -282,52 +506,264 @@ struct Party
     apk = kp.publicKey;
   }
 
-  void compute_on_r(const Tuple<vector<CT>> *M, Tuple<vector<CT>> *R, const vector<string> &X, bool iu, bool run_sum)
+  // Inserts X into hm and builds the plaintexts this provider combines with M
+  void prepare_map(HashMap &hm, const SetView &X, bool iu, vector<PT> &hm_pt, vector<PT> &hm_1hot, vector<PT> &hm_0hot)
+  {
+    TraceSpan span("prepare_map");
+    insert_map(hm, X);
+    prepare_chunk(hm, iu, 0, hm.n_ciphertexts(pro_parms.batch_size), hm_pt, hm_1hot, hm_0hot);
+  }
+
+  // The plaintext-free half of prepare_map: fills every slot of hm
+  void insert_map(HashMap &hm, const SetView &X)
+  {
+    if (pro_parms.num_hash_fns > 1)
+    {
+      // Cuckoo hashing: M holds one delegate element per slot, which may match
+      // any element in the provider's bin for that slot
+      hm.insert_bins(X);
+      hm.fill_empty_random();
+    }
+    else
+    {
+      hm.insert(X);
+      if (pro_parms.party_id == 1)
+        hm.fill_empty_random();
+      else
+        hm.fill_empty_zeros();
+    }
+  }
+
+  // Builds the plaintexts of ciphertexts [begin, end) of M from an inserted map
+  void prepare_chunk(HashMap &hm, bool iu, size_t begin, size_t end, vector<PT> &hm_pt, vector<PT> &hm_1hot, vector<PT> &hm_0hot)
+  {
+    if (pro_parms.party_id != 1)
+      hm.hot_encoding_range(bfv_ctx, hm_1hot, hm_0hot, pro_parms.batch_size, iu, begin, end);
+    if (pro_parms.num_hash_fns == 1)
+      hm.serialize_range(bfv_ctx, hm_pt, false, pro_parms.batch_size, begin, end);
+  }
+
+  static size_t serialized_bytes(const CT &ct)
+  {
+    stringstream ss;
+    Serial::Serialize(ct, ss, SerType::BINARY);
+    return ss.str().size();
+  }
+
+  /*
+    Ciphertexts per chunk so that the chunk's plaintexts, on top of M and R,
+    fit in budget bytes. on_disk is for M and R kept in a CtStore: only the
+    three segments stream_segments holds (read-ahead, current, write-behind)
+    of each are in memory, so those scale with the chunk instead. Sizes are
+    estimated from one encryption of zero, and for MPSI-Sum one CKKS
+    encryption under apk, so apk must be set, and with --sparse the
+    delegate's map must have been built.
+  */
+  size_t chunk_for_budget(size_t budget, bool on_disk = false)
+  {
+    // A sparse M holds only the plaintexts ct_pt lists
+    size_t n_ct = (pro_parms.map_sz + pro_parms.batch_size - 1) / pro_parms.batch_size;
+    if (pro_parms.sparse && pro_parms.ct_pt != nullptr)
+      n_ct = pro_parms.ct_pt->size();
+    CT ct;
+    encrypt_zero_single(bfv_ctx, pro_parms.pk, &ct);
+    size_t ct_bytes = serialized_bytes(ct);
+    // An encoded plaintext is one polynomial plus its coefficient vector
+    size_t pt_bytes = (ct_bytes / 2) + (bfv_ctx->GetRingDimension() * sizeof(int64_t));
+    size_t map_bytes = pro_parms.map_sz * pro_parms.hash_sz;
+    // Bytes of M[i] or R[i]: M.e1 and R.e1 hold a CKKS ciphertext per BFV one
+    size_t entry_bytes = ct_bytes;
+    if (pro_parms.with_ad)
+    {
+      PT ckks_pt = ckks_ctx->MakeCKKSPackedPlaintext(vector<double>{0.0});
+      entry_bytes += serialized_bytes(ckks_ctx->Encrypt(pro_parms.apk, ckks_pt));
+      map_bytes += pro_parms.map_sz * sizeof(decltype(HashMap::ad_data)::value_type);
+    }
+    size_t per_ct = 3 * pt_bytes;
+    size_t resident = map_bytes;
+    if (on_disk)
+      per_ct += 3 * 2 * entry_bytes;
+    else
+      resident += 2 * n_ct * entry_bytes;
+
+    size_t min_chunk = pro_parms.pool->get_thread_count();
+    size_t chunk = (budget > resident) ? (budget - resident) / per_ct : 0;
+    if (chunk < min_chunk)
+    {
+      printf("Memory budget %.0f MB is below the %.0f MB %s; using %lu ciphertexts per chunk\n", (double)budget / (1 << 20), (double)resident / (1 << 20), on_disk ? "the map needs" : "M, R and the map need", min_chunk);
+      chunk = min_chunk;
+    }
+    return min(chunk, n_ct);
+  }
+
+  void compute_on_r(const Tuple<vector<CT>> *M, Tuple<vector<CT>> *R, const SetView &X, bool iu, bool run_sum)
   {
     Stopwatch sw;
     string protocol = string(iu ? "MPSIU" : "MPSI") + string(run_sum ? "-Sum" : "");
     print_title(protocol + ": Party " + to_string(pro_parms.party_id));
     sw.start();
+    TraceSpan span("compute_on_r", pro_parms.party_id);
 
     HashMap hm(pro_parms);
+    vector<PT> hm_pt, hm_1hot, hm_0hot;
     size_t m_sz = M->e0.size();
-    vector<PT> hm_pt(m_sz), hm_1hot(m_sz), hm_0hot(m_sz);
+    size_t chunk_sz = (pro_parms.chunk_ct > 0) ? pro_parms.chunk_ct : m_sz;
+    {
+      TraceSpan span("prepare_map");
+      insert_map(hm, X);
+    }
+
+    // Compute R => R + (M - Enc(hm)) in one pass over the ciphertexts, building
+    // and freeing the plaintexts of one chunk at a time
+    if (pro_parms.num_hash_fns > 1)
+      cout << "Computing R => R + prod(M - Enc(bin))" << endl;
+    else
+      cout << "Computing R => R + (M - Enc(hm))" << endl;
+    if (chunk_sz < m_sz)
+      cout << "Chunks of " << chunk_sz << " ciphertexts" << endl;
+    for (size_t begin = 0; begin < m_sz; begin += chunk_sz)
+    {
+      size_t end = min(begin + chunk_sz, m_sz);
+      prepare_chunk(hm, iu, begin, end, hm_pt, hm_1hot, hm_0hot);
+      assert(hm_pt.empty() || hm_pt.size() == end - begin);
+      update_r_range(M->e0, hm, hm_pt, hm_1hot, hm_0hot, R->e0, begin, end, begin);
+    }
+    hm_pt = vector<PT>();
+    hm_1hot = vector<PT>();
+    hm_0hot = vector<PT>();
+    if (pro_parms.party_id == 1)
+      R->e1 = M->e1;
 
-    vector<PT> v_pt;
-    hm.insert(X);
-    hm.hot_encoding_mask(bfv_ctx, hm_1hot, hm_0hot, pro_parms.batch_size);
-    // hm.hot_encoding_mask(bfv_ctx, hm_0hot, true, pro_parms.batch_size);
-    hm.serialize(bfv_ctx, ckks_ctx, hm_pt, v_pt, (pro_parms.party_id == 1), pro_parms.batch_size, pro_parms.num_threads);
+    // The last party randomizes the ciphertexts
+    if (pro_parms.party_id == pro_parms.num_parties - 1)
+      randomize_all_inplace(R);
 
-    // Compute R => R + (M - Enc(hm))
-    cout << "Computing R => R + (M - Enc(hm))" << endl;
-    vector<CT> Mdiff_temp(m_sz);
-    subtract_all(M->e0, hm_pt, Mdiff_temp);
+    printf("\nTime: %5.2fs\n", sw.elapsed());
+  }
 
-    if (pro_parms.party_id == 1)
+  /*
+    compute_on_r over ciphertexts kept on disk: M and R stream through memory
+    one segment at a time, with that segment's plaintexts. The last provider
+    randomizes each segment and then shuffles R by copying serialized
+    ciphertexts between segments.
+  */
+  void compute_on_r_store(const Tuple<CtStore> &M, Tuple<CtStore> &R, const SetView &X, bool iu, bool run_sum)
+  {
+    Stopwatch sw;
+    string protocol = string(iu ? "MPSIU" : "MPSI") + string(run_sum ? "-Sum" : "");
+    print_title(protocol + ": Party " + to_string(pro_parms.party_id));
+    sw.start();
+    TraceSpan span("compute_on_r", pro_parms.party_id);
+
+    HashMap hm(pro_parms);
     {
-      R->e0 = Mdiff_temp;
-      R->e1 = M->e1;
+      TraceSpan span("prepare_map");
+      insert_map(hm, X);
     }
-    else
+    cout << "Streaming " << M.e0.n_segments() << " segments of " << M.e0.seg_ct << " ciphertexts" << endl;
+
+    bool first = (pro_parms.party_id == 1), last = (pro_parms.party_id == pro_parms.num_parties - 1);
+    bool ad = pro_parms.with_ad;
+    // Slots: R.e0, R.e1, M.e0, M.e1. R.e1 is M.e1 until the last provider
+    // randomizes it.
+    vector<const CtStore *> ins = {first ? nullptr : &R.e0, (ad && last && !first) ? &R.e1 : nullptr, &M.e0, (ad && first) ? &M.e1 : nullptr};
+    vector<CtStore *> outs = {&R.e0, (ad && (first || last)) ? &R.e1 : nullptr, nullptr, nullptr};
+    vector<PT> hm_pt, hm_1hot, hm_0hot;
+    stream_segments(ins, outs, *pro_parms.pool, [&](size_t k, vector<vector<CT>> &io)
+                    {
+                      size_t begin = M.e0.seg_begin(k), end = begin + io[2].size();
+                      prepare_chunk(hm, iu, begin, end, hm_pt, hm_1hot, hm_0hot);
+                      update_r_range(io[2], hm, hm_pt, hm_1hot, hm_0hot, io[0], begin, end, begin, begin);
+                      if (first && ad)
+                        io[1] = move(io[3]);
+                      if (last)
+                      {
+                        Tuple<vector<CT>> seg;
+                        swap(seg.e0, io[0]);
+                        swap(seg.e1, io[1]);
+                        randomize_range(&seg, 0, seg.e0.size());
+                        swap(seg.e0, io[0]);
+                        swap(seg.e1, io[1]);
+                      } });
+
+    if (last)
     {
-      vector<CT> Mdiff(m_sz);
-      multiply_all(Mdiff_temp, hm_1hot, Mdiff);
-      if (iu)
+      vector<size_t> idx = draw_permutation(R.e0.count);
+      TraceSpan span("permute");
+      for (CtStore *r : {&R.e0, &R.e1})
       {
-        vector<CT> Rdiff(m_sz);
-        multiply_all(R->e0, hm_0hot, Rdiff);
-        add_all_inplace(Rdiff, Mdiff);
-        R->e0 = Rdiff;
+        if (r == &R.e1 && !ad)
+          continue;
+        CtStore tmp(r->prefix + ".perm", r->count, r->seg_ct);
+        r->permute(idx, tmp);
+        r->replace_with(tmp);
       }
+    }
+    printf("\nTime: %5.2fs\n", sw.elapsed());
+  }
+
+  /*
+    Pipelined compute_on_r: R is processed in chunks of chunk_sz ciphertexts,
+    each as soon as the previous stage (prev, null for the first provider) has
+    published it; finished chunks are published to next. The last provider
+    randomizes each chunk as it goes, but the shuffle spans all of R and is
+    only applied once the last chunk is done.
+  */
+  void compute_on_r_streamed(const Tuple<vector<CT>> *M, Tuple<vector<CT>> *R, const SetView &X, bool iu, size_t chunk_sz, ChunkProgress *prev, ChunkProgress &next)
+  {
+    TraceSpan span("compute_on_r", pro_parms.party_id);
+    HashMap hm(pro_parms);
+    vector<PT> hm_pt, hm_1hot, hm_0hot;
+    prepare_map(hm, X, iu, hm_pt, hm_1hot, hm_0hot);
+
+    bool last = (pro_parms.party_id == pro_parms.num_parties - 1);
+    size_t m_sz = M->e0.size();
+    size_t n_chunks = (m_sz + chunk_sz - 1) / chunk_sz;
+    for (size_t j = 0; j < n_chunks; j++)
+    {
+      size_t begin = j * chunk_sz, end = min(begin + chunk_sz, m_sz);
+      if (prev != nullptr)
+        prev->wait_for(j + 1);
+      update_r_range(M->e0, hm, hm_pt, hm_1hot, hm_0hot, R->e0, begin, end);
+      if (pro_parms.party_id == 1 && pro_parms.with_ad)
+      {
+        for (size_t i = begin; i < end; i++)
+          R->e1[i] = M->e1[i];
+      }
+      if (last)
+        randomize_range(R, begin, end);
       else
-        add_all_inplace(R->e0, Mdiff);
+        next.publish(j + 1);
+    }
+    if (last)
+    {
+      apply_permutation(R, draw_permutation(m_sz));
+      next.publish(n_chunks);
     }
+  }
 
-    // The last party randomizes the ciphertexts
-    if (pro_parms.party_id == pro_parms.num_parties - 1)
-      randomize_all_inplace(R);
+  /*
+    Tree aggregation: this provider's contribution (M - Enc(hm)) * one_hot,
+    computed without R. For MPSI the shares of all providers simply add up;
+    for MPSIU each provider keeps its zero-hot mask to fold its share into R
+    in party order with fold_share.
+  */
+  void compute_share(const Tuple<vector<CT>> *M, const SetView &X, bool iu, Share &share)
+  {
+    TraceSpan span("compute_share", pro_parms.party_id);
+    HashMap hm(pro_parms);
+    vector<PT> hm_pt, hm_1hot;
+    prepare_map(hm, X, iu, hm_pt, hm_1hot, share.zero_hot);
+    share_all(M->e0, hm, hm_pt, hm_1hot, share.ct);
+  }
 
-    printf("\nTime: %5.2fs\n", sw.elapsed());
+  // R => R * zero_hot + share (MPSIU)
+  void fold_share(vector<CT> &R, const Share &share)
+  {
+    assert(R.size() == share.ct.size());
+    parallel_for("fold", *pro_parms.pool, R.size(), [this, &R, &share](const size_t start, const size_t end)
+                 {
+                   for (size_t i = start; i < end; i++)
+                     fold_single(bfv_ctx, &share.ct[i], share.zero_hot.empty() ? nullptr : &share.zero_hot[i], &R[i]); });
   }
 };
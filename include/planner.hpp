@@ -0,0 +1,382 @@
+#pragma once
+
+#include <optional>
+#include "crypto.hpp"
+#include "hashmap.hpp"
+#include "party.hpp"
+
+using namespace std;
+using namespace lbcrypto;
+
+/* -------------------------------------- */
+
+// Seconds one call of each kernel takes on one thread, and the size of a
+// serialized ciphertext
+struct OpCosts
+{
+  double encode = 0, encrypt = 0, sub = 0, mult_pt = 0, mult_ct = 0, add = 0, decrypt = 0;
+  double ckks_encrypt = 0, ckks_mult = 0;
+  size_t ct_bytes = 0;
+};
+
+// The run being planned
+struct PlanRequest
+{
+  size_t n, x0, xi, map_sz, nthreads, stat_sec, tag_sz;
+  bool iu, run_sum, sparse = false;
+};
+
+// Candidates for every choice; main narrows each to the user's value when
+// the flag is given
+struct PlanSpace
+{
+  vector<size_t> ring_dims = {8192, 16384, 32768, 65536};
+  vector<size_t> pt_bits = {16, 30, 60};
+  vector<size_t> hash_fns = {1, 2, 3};
+  vector<PackingType> packs = {MULTIPLE_COMPACT, MULTIPLE};
+};
+
+struct PlanConfig
+{
+  size_t ring_dim, pt_bits, tag_sz, map_sz, num_hash_fns, bin_sz, depth, batch_size, n_ct;
+  uint64_t plain_mod;
+  PackingType pack_type;
+  double est_s, est_mb;
+
+  // The flags that run this configuration
+  string flags() const
+  {
+    string s = "--ring " + to_string(ring_dim) + " --pt-bits " + to_string(pt_bits) + " --tag " + to_string(tag_sz);
+    s += " --pack " + string((pack_type == MULTIPLE_COMPACT) ? "compact" : "multiple");
+    if (num_hash_fns > 1)
+      s += " --cuckoo " + to_string(num_hash_fns);
+    else
+      s += " --cuckoo 0 --map " + to_string(map_sz);
+    return s;
+  }
+};
+
+/*
+  Cost model of one run: every phase does a fixed set of kernel calls per
+  ciphertext of M, spread over the pool's threads.
+    delegate start    encode + encrypt
+    first provider    L (encode + sub) + (L - 1) mult_ct, L tags per bin
+    other providers   the above + encode + mult_pt + add, and for MPSIU
+                      another encode + mult_pt
+    randomization     encode + mult_pt
+    delegate finish   decrypt
+  MPSI-Sum adds a CKKS encryption and weighting per ciphertext. Hashing and
+  communication do not depend on the HE parameters and are left out.
+*/
+inline double estimate_seconds(const PlanRequest &req, const PlanConfig &c, const OpCosts &op)
+{
+  double bins = (double)c.bin_sz;
+  double first = bins * (op.encode + op.sub) + (bins - 1) * op.mult_ct;
+  double other = first + op.encode + op.mult_pt + op.add + (req.iu ? op.encode + op.mult_pt : 0);
+  double per_ct = op.encode + op.encrypt + first + (double)(req.n - 2) * other + op.encode + op.mult_pt + op.decrypt;
+  if (req.run_sum)
+    per_ct += op.ckks_encrypt + op.ckks_mult;
+  return (double)c.n_ct * per_ct / (double)max(req.nthreads, (size_t)1);
+}
+
+/*
+  Enumerates every valid configuration of space and ranks them by estimated
+  time, fastest first. costs(ring_dim, plain_mod, depth) gives the kernel
+  costs of a BFV parameter set, or nothing if it cannot be instantiated at
+  the requested security level.
+*/
+template <typename CostFn>
+vector<PlanConfig> plan_configs(const PlanRequest &req, const PlanSpace &space, CostFn &&costs)
+{
+  vector<PlanConfig> configs;
+  for (size_t h : space.hash_fns)
+  {
+    size_t map_sz = req.map_sz, bin_sz = 1, depth = 1;
+    if (h > 1)
+    {
+      map_sz = cuckoo_map_size(h, req.x0);
+      bin_sz = max_bin_load(h * req.xi, map_sz);
+      depth += (size_t)ceil(log2((double)bin_sz));
+    }
+    // Bins too full for a tag of at most MAX_TAG_BYTES rule out this h
+    size_t tag_sz = req.tag_sz;
+    if (tag_sz == 0)
+    {
+      try
+      {
+        tag_sz = tag_bytes_for(map_sz, req.n, bin_sz, req.stat_sec);
+      }
+      catch (const runtime_error &)
+      {
+        continue;
+      }
+    }
+
+    for (size_t ring_dim : space.ring_dims)
+    {
+      bool bitwise_done = false;
+      for (size_t bits : space.pt_bits)
+      {
+        uint64_t plain_mod;
+        try
+        {
+          plain_mod = bfv_plain_modulus(ring_dim, bits);
+        }
+        catch (const runtime_error &)
+        {
+          continue;
+        }
+        for (PackingType pack : space.packs)
+        {
+          // Bitwise packing uses one bit of a coefficient: a larger modulus
+          // only costs
+          if (pack == MULTIPLE && bitwise_done)
+            continue;
+          size_t batch_size = n_hashes_in_pt(pack, ring_dim, bits, tag_sz * 8);
+          if (batch_size == 0 || (req.run_sum && batch_size > ring_dim / 2))
+            continue;
+          optional<OpCosts> op = costs(ring_dim, plain_mod, depth);
+          if (!op)
+            continue;
+          bitwise_done |= (pack == MULTIPLE);
+
+          PlanConfig c = {ring_dim, bits, tag_sz, map_sz, h, bin_sz, depth, batch_size, (map_sz + batch_size - 1) / batch_size, plain_mod, pack, 0, 0};
+          // A sparse map sends the plaintexts some of x0 uniform slots fall in
+          if (req.sparse)
+            c.n_ct = min(c.n_ct, (size_t)ceil((double)c.n_ct * -expm1((double)req.x0 * log1p(-1.0 / (double)c.n_ct))));
+          c.est_s = estimate_seconds(req, c, *op);
+          // M and R
+          c.est_mb = (double)(2 * c.n_ct * op->ct_bytes) / (1 << 20);
+          configs.push_back(c);
+        }
+      }
+    }
+  }
+  sort(configs.begin(), configs.end(), [](const PlanConfig &a, const PlanConfig &b)
+       { return a.est_s < b.est_s; });
+  return configs;
+}
+
+/* -------------------------------------- */
+
+// Median seconds of reps calls of f, after one untimed call
+template <typename F>
+double time_op(size_t reps, F &&f)
+{
+  f();
+  vector<double> t(reps);
+  Stopwatch sw;
+  for (size_t i = 0; i < reps; i++)
+  {
+    sw.start();
+    f();
+    t[i] = sw.elapsed();
+  }
+  sort(t.begin(), t.end());
+  return t[reps / 2];
+}
+
+// Reads costs kept at path into op; false if there are none. *invalid is
+// set when the parameters were found not instantiable.
+inline bool read_costs(const string &path, OpCosts &op, bool *invalid)
+{
+  if (path == "" || !ifstream(path).good())
+    return false;
+  map<string, double> v;
+  for (auto &[key, val] : RunReport::read(path).entries)
+    v[key] = stod(val);
+  *invalid = (v.count("invalid") > 0);
+  op = {v["encode"], v["encrypt"], v["sub"], v["mult_pt"], v["mult_ct"], v["add"], v["decrypt"], v["ckks_encrypt"], v["ckks_mult"], (size_t)v["ct_bytes"]};
+  return true;
+}
+
+inline void write_costs(const string &path, const OpCosts &op)
+{
+  if (path == "")
+    return;
+  RunReport report;
+  report.add("encode", op.encode);
+  report.add("encrypt", op.encrypt);
+  report.add("sub", op.sub);
+  report.add("mult_pt", op.mult_pt);
+  report.add("mult_ct", op.mult_ct);
+  report.add("add", op.add);
+  report.add("decrypt", op.decrypt);
+  report.add("ckks_encrypt", op.ckks_encrypt);
+  report.add("ckks_mult", op.ckks_mult);
+  report.add("ct_bytes", op.ct_bytes);
+  report.write(path);
+}
+
+/*
+  Builds a throwaway context for parms. If OpenFHE refuses the parameters,
+  that is remembered at path; other failures, such as running out of memory,
+  are not, so a later run measures the set again.
+*/
+template <typename P>
+inline optional<CryptoContext<DCRTPoly>> calibration_ctx(shared_ptr<CCParams<P>> &parms, const string &path)
+{
+  try
+  {
+    return gen_crypto_ctx(parms);
+  }
+  catch (const bad_alloc &)
+  {
+    printf("  out of memory\n");
+    return nullopt;
+  }
+  catch (const exception &e)
+  {
+    printf("  not instantiable: %s\n", e.what());
+    if (path != "")
+    {
+      RunReport report;
+      report.add("invalid", 1);
+      report.write(path);
+    }
+    return nullopt;
+  }
+}
+
+/*
+  Measures the kernels of one BFV parameter set on this machine. The
+  context is built only for this and dropped with its keys afterwards. With
+  a context cache directory the costs are kept there and measured only once.
+*/
+inline optional<OpCosts> calibrate_costs(size_t ring_dim, uint64_t plain_mod, size_t depth, SecurityLevel sec, size_t reps = 3)
+{
+  shared_ptr<CCParams<CryptoContextBFVRNS>> bfv_parms = make_bfv_params(ring_dim, depth, plain_mod, sec);
+  string path = ContextCache::dir.empty() ? "" : ContextCache::dir + "/" + ContextCache::stem("plan", *bfv_parms) + ".costs";
+  OpCosts op;
+  bool invalid = false;
+  if (read_costs(path, op, &invalid))
+    return invalid ? nullopt : optional<OpCosts>(op);
+
+  printf("Calibrating ring %lu, %lu-bit plaintext modulus, depth %lu\n", ring_dim, plain_mod_bits(plain_mod), depth);
+  optional<CryptoContext<DCRTPoly>> made = calibration_ctx(bfv_parms, path);
+  if (!made)
+    return nullopt;
+  CryptoContext<DCRTPoly> ctx = *made;
+  string key_tag;
+  try
+  {
+    KeyPair<DCRTPoly> kp = ctx->KeyGen();
+    if (depth > 1)
+    {
+      ctx->EvalMultKeyGen(kp.secretKey);
+      key_tag = kp.secretKey->GetKeyTag();
+    }
+
+    vector<int64_t> int_vec(ring_dim);
+    random_ints(int_vec, plain_mod);
+    PT pt = ctx->MakePackedPlaintext(int_vec), pt_out;
+    CT ct = ctx->Encrypt(kp.publicKey, pt), ct_out;
+
+    op.encode = time_op(reps, [&]()
+                        { pt_out = ctx->MakePackedPlaintext(int_vec); });
+    op.encrypt = time_op(reps, [&]()
+                         { encrypt_single(ctx, kp.publicKey, &pt, &ct_out); });
+    op.sub = time_op(reps, [&]()
+                     { subtract_single(ctx, &ct, &pt, &ct_out); });
+    op.mult_pt = time_op(reps, [&]()
+                         { multiply_single(ctx, &ct, &pt, &ct_out); });
+    if (depth > 1)
+      op.mult_ct = time_op(reps, [&]()
+                           { ct_out = ctx->EvalMult(ct, ct); });
+    op.add = time_op(reps, [&]()
+                     { ct_out = ctx->EvalAdd(ct, ct); });
+    op.decrypt = time_op(reps, [&]()
+                         { ctx->Decrypt(kp.secretKey, ct, &pt_out); });
+    op.ct_bytes = Party::serialized_bytes(ct);
+  }
+  catch (const exception &e)
+  {
+    printf("  calibration failed: %s\n", e.what());
+    if (!key_tag.empty())
+      ctx->ClearEvalMultKeys(key_tag);
+    return nullopt;
+  }
+  // EvalMult keys live in OpenFHE's static key map until cleared
+  if (!key_tag.empty())
+    ctx->ClearEvalMultKeys(key_tag);
+  write_costs(path, op);
+  return op;
+}
+
+// The CKKS kernels of MPSI-Sum at ring_dim, which depend on nothing else;
+// only ckks_encrypt and ckks_mult of the result are set
+inline optional<OpCosts> calibrate_ckks_costs(size_t ring_dim, SecurityLevel sec, size_t reps = 3)
+{
+  shared_ptr<CCParams<CryptoContextCKKSRNS>> ckks_parms = make_ckks_params(ring_dim, sec);
+  string path = ContextCache::dir.empty() ? "" : ContextCache::dir + "/" + ContextCache::stem("plan-ckks", *ckks_parms) + ".costs";
+  OpCosts op;
+  bool invalid = false;
+  if (read_costs(path, op, &invalid))
+    return invalid ? nullopt : optional<OpCosts>(op);
+
+  printf("Calibrating CKKS at ring %lu\n", ring_dim);
+  optional<CryptoContext<DCRTPoly>> made = calibration_ctx(ckks_parms, path);
+  if (!made)
+    return nullopt;
+  CryptoContext<DCRTPoly> ckks_ctx = *made;
+  try
+  {
+    KeyPair<DCRTPoly> ckks_kp = ckks_ctx->KeyGen();
+    vector<double> dbl_vec(ring_dim / 2, 1.0);
+    PT ckks_pt = ckks_ctx->MakeCKKSPackedPlaintext(dbl_vec);
+    CT ckks_ct = ckks_ctx->Encrypt(ckks_kp.publicKey, ckks_pt), ckks_out;
+    op.ckks_encrypt = time_op(reps, [&]()
+                              { ckks_out = ckks_ctx->Encrypt(ckks_kp.publicKey, ckks_ctx->MakeCKKSPackedPlaintext(dbl_vec)); });
+    op.ckks_mult = time_op(reps, [&]()
+                           { ckks_out = ckks_ctx->EvalMult(ckks_ct, ckks_pt); });
+  }
+  catch (const exception &e)
+  {
+    printf("  calibration failed: %s\n", e.what());
+    return nullopt;
+  }
+  write_costs(path, op);
+  return op;
+}
+
+// Plans req on this machine: every BFV parameter set is calibrated once, and
+// for MPSI-Sum CKKS once per ring dimension
+inline vector<PlanConfig> plan_run(const PlanRequest &req, const PlanSpace &space, SecurityLevel sec)
+{
+  map<tuple<size_t, uint64_t, size_t>, optional<OpCosts>> measured;
+  map<size_t, optional<OpCosts>> ckks_measured;
+  return plan_configs(req, space, [&measured, &ckks_measured, &req, sec](size_t ring_dim, uint64_t plain_mod, size_t depth)
+                      {
+                        auto key = make_tuple(ring_dim, plain_mod, depth);
+                        if (measured.count(key) == 0)
+                          measured[key] = calibrate_costs(ring_dim, plain_mod, depth, sec);
+                        optional<OpCosts> op = measured[key];
+                        if (!op || !req.run_sum)
+                          return op;
+                        if (ckks_measured.count(ring_dim) == 0)
+                          ckks_measured[ring_dim] = calibrate_ckks_costs(ring_dim, sec);
+                        const optional<OpCosts> &ckks = ckks_measured[ring_dim];
+                        if (!ckks)
+                          return optional<OpCosts>();
+                        op->ckks_encrypt = ckks->ckks_encrypt;
+                        op->ckks_mult = ckks->ckks_mult;
+                        return op; });
+}
+
+inline void print_plan(const vector<PlanConfig> &configs, size_t top = 10)
+{
+  print_title("Plan");
+  if (configs.empty())
+  {
+    cout << "No valid configuration." << endl;
+    return;
+  }
+  printf("%8s %5s %4s %9s %6s %5s %6s %8s %9s %10s\n", "ring", "bits", "tag", "map", "hashes", "depth", "batch", "cts", "est s", "M+R MB");
+  for (size_t i = 0; i < min(top, configs.size()); i++)
+  {
+    const PlanConfig &c = configs[i];
+    printf("%8lu %5lu %4lu %9lu %6lu %5lu %6lu %8lu %9.2f %10.1f %s\n", c.ring_dim, c.pt_bits, c.tag_sz, c.map_sz, c.num_hash_fns, c.depth, c.batch_size, c.n_ct, c.est_s, c.est_mb, (c.pack_type == MULTIPLE) ? "bitwise" : "");
+  }
+  cout << "Chosen: " << configs[0].flags() << endl;
+  print_sep();
+}
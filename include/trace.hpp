@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* -------------------------------------- */
+
+struct TraceEvent
+{
+  const char *name;
+  uint64_t t0, t1;
+  uint32_t party, tid;
+};
+
+/*
+  Scoped nanosecond spans, buffered per thread without locking and exported
+  at the end of a run as a Chrome trace (chrome://tracing, Perfetto) plus a
+  per-phase JSON summary. Spans carry the party they run for: a TraceSpan
+  given a party id sets it for everything nested in it, and parallel_for
+  hands it on to the pool tasks it starts. Disabled, a span is one branch.
+*/
+struct Tracer
+{
+  static inline atomic<bool> enabled{false};
+  static inline uint64_t epoch = 0;
+  static inline mutex mtx;
+  static inline vector<shared_ptr<vector<TraceEvent>>> buffers;
+  static inline atomic<uint32_t> n_threads{0};
+
+  static inline uint64_t now()
+  {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static void enable()
+  {
+    epoch = now();
+    enabled = true;
+  }
+
+  static inline uint32_t &party()
+  {
+    static thread_local uint32_t p = 0;
+    return p;
+  }
+
+  static inline uint32_t tid()
+  {
+    static thread_local uint32_t id = n_threads++;
+    return id;
+  }
+
+  static vector<TraceEvent> &local()
+  {
+    static thread_local shared_ptr<vector<TraceEvent>> buf;
+    if (buf == nullptr)
+    {
+      buf = make_shared<vector<TraceEvent>>();
+      buf->reserve(1 << 12);
+      lock_guard<mutex> lock(mtx);
+      buffers.push_back(buf);
+    }
+    return *buf;
+  }
+
+  static vector<TraceEvent> collect()
+  {
+    lock_guard<mutex> lock(mtx);
+    vector<TraceEvent> all;
+    for (auto &b : buffers)
+      all.insert(all.end(), b->begin(), b->end());
+    return all;
+  }
+
+  // Writes the Chrome trace to path and the summary to path.summary.json;
+  // call once the pool is idle
+  static void write(const string &path)
+  {
+    vector<TraceEvent> all = collect();
+    set<uint32_t> parties;
+    for (auto &e : all)
+      parties.insert(e.party);
+
+    ofstream out(path);
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (uint32_t p : parties)
+    {
+      out << (first ? "" : ",\n") << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << p << ",\"args\":{\"name\":\"" << ((p == 0) ? string("Delegate") : "Party " + to_string(p)) << "\"}}";
+      first = false;
+    }
+    char buf[256];
+    for (auto &e : all)
+    {
+      snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u}", e.name, (double)(e.t0 - epoch) / 1e3, (double)(e.t1 - e.t0) / 1e3, e.party, e.tid);
+      out << (first ? "" : ",\n") << buf;
+      first = false;
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    // busy = summed span time, wall = first start to last end, so
+    // busy / (wall * threads) is how well the phase kept its threads occupied
+    struct Agg
+    {
+      size_t count = 0;
+      uint64_t busy = 0, t0 = UINT64_MAX, t1 = 0;
+      set<uint32_t> tids;
+    };
+    map<pair<uint32_t, string>, Agg> summary;
+    for (auto &e : all)
+    {
+      Agg &a = summary[{e.party, e.name}];
+      a.count++;
+      a.busy += e.t1 - e.t0;
+      a.t0 = min(a.t0, e.t0);
+      a.t1 = max(a.t1, e.t1);
+      a.tids.insert(e.tid);
+    }
+    ofstream sum_out(path + ".summary.json");
+    sum_out << "{\"spans\":[\n";
+    first = true;
+    for (auto &[key, a] : summary)
+    {
+      double wall = (double)(a.t1 - a.t0) / 1e6, busy = (double)a.busy / 1e6;
+      snprintf(buf, sizeof(buf), "{\"party\":%u,\"name\":\"%s\",\"count\":%lu,\"busy_ms\":%.3f,\"wall_ms\":%.3f,\"threads\":%lu,\"utilization\":%.3f}", key.first, key.second.c_str(), a.count, busy, wall, a.tids.size(), (wall > 0) ? busy / (wall * a.tids.size()) : 1.0);
+      sum_out << (first ? "" : ",\n") << buf;
+      first = false;
+    }
+    sum_out << "\n]}\n";
+  }
+};
+
+// name must outlive the run (a string literal)
+struct TraceSpan
+{
+  const char *name;
+  uint64_t t0;
+  uint32_t party, saved;
+  bool on;
+
+  TraceSpan(const char *span_name) : TraceSpan(span_name, Tracer::party()) {}
+
+  TraceSpan(const char *span_name, size_t party_id) : name(span_name), on(Tracer::enabled)
+  {
+    if (!on)
+      return;
+    saved = Tracer::party();
+    party = (uint32_t)party_id;
+    Tracer::party() = party;
+    t0 = Tracer::now();
+  }
+
+  ~TraceSpan()
+  {
+    if (!on)
+      return;
+    Tracer::local().push_back({name, t0, Tracer::now(), party, Tracer::tid()});
+    Tracer::party() = saved;
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+};
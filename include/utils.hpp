@@ -11,6 +11,16 @@
 #include <cassert>
 #include <chrono>
 #include <random>
+#include <string_view>
+#include <sstream>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 
 using namespace std;
 using namespace std::chrono;
@@ -31,7 +41,70 @@ struct Stopwatch
   inline double elapsed()
   {
     auto t1 = high_resolution_clock::now();
-    return std::chrono::duration_cast<milliseconds>(t1 - t0).count() / 1e3;
+    return std::chrono::duration<double>(t1 - t0).count();
+  }
+};
+
+// Memory counters of this process from /proc/self/status, in MB
+inline double proc_status_mb(const char *key)
+{
+  ifstream in("/proc/self/status");
+  string line;
+  size_t len = strlen(key);
+  while (getline(in, line))
+  {
+    if (line.compare(0, len, key) == 0 && line.size() > len && line[len] == ':')
+      return stod(line.substr(len + 1)) / 1024;
+  }
+  return 0;
+}
+
+inline double peak_rss_mb()
+{
+  return proc_status_mb("VmHWM");
+}
+
+// Restarts the peak RSS at the current RSS (Linux 4.0+); where that is not
+// supported, peaks count from startup
+inline void reset_peak_rss()
+{
+  ofstream out("/proc/self/clear_refs");
+  out << "5";
+}
+
+// Named results of one run, kept in insertion order and written as
+// "key,value" lines for the sweep harness to collect
+struct RunReport
+{
+  vector<pair<string, string>> entries;
+
+  template <typename T>
+  void add(const string &key, const T &val)
+  {
+    ostringstream ss;
+    ss << val;
+    entries.push_back({key, ss.str()});
+  }
+
+  void write(const string &path)
+  {
+    ofstream out(path);
+    for (auto &[key, val] : entries)
+      out << key << "," << val << endl;
+  }
+
+  static RunReport read(const string &path)
+  {
+    RunReport r;
+    ifstream in(path);
+    string line;
+    while (getline(in, line))
+    {
+      size_t comma = line.find(',');
+      if (comma != string::npos)
+        r.entries.push_back({line.substr(0, comma), line.substr(comma + 1)});
+    }
+    return r;
   }
 };
 
@@ -150,18 +223,120 @@ vector<string> random_strings(size_t num)
   return ret;
 }
 
+// AES-256-CTR keystream seeded from RAND_bytes, handed out in large blocks.
+// A forked child inherits the key, counter and buffer, so callers run
+// check_fork() before a batch of next() calls to reseed in a new process.
+struct CtrDrbg
+{
+  static const size_t BUF_SZ = 1 << 14;
+  static const size_t RESEED_BYTES = 1ULL << 32;
+
+  EVP_CIPHER_CTX *ctx;
+  vector<uint8_t> buf;
+  size_t pos, generated;
+  pid_t pid;
+
+  CtrDrbg() : ctx(EVP_CIPHER_CTX_new()), buf(BUF_SZ), pos(BUF_SZ), generated(0)
+  {
+    reseed();
+  }
+
+  ~CtrDrbg()
+  {
+    EVP_CIPHER_CTX_free(ctx);
+  }
+
+  CtrDrbg(const CtrDrbg &) = delete;
+  CtrDrbg &operator=(const CtrDrbg &) = delete;
+
+  void reseed()
+  {
+    uint8_t seed[48];
+    random_bytes(seed, sizeof(seed));
+    int err = EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, seed, seed + 32);
+    assert(err == 1);
+    OPENSSL_cleanse(seed, sizeof(seed));
+    generated = 0;
+    pid = getpid();
+  }
+
+  // Drops the buffered keystream and reseeds if this is a forked copy
+  inline void check_fork()
+  {
+    if (getpid() != pid)
+    {
+      reseed();
+      pos = BUF_SZ;
+    }
+  }
+
+  void refill()
+  {
+    if (generated >= RESEED_BYTES || getpid() != pid)
+      reseed();
+    int len;
+    memset(buf.data(), 0, BUF_SZ);
+    EVP_EncryptUpdate(ctx, buf.data(), &len, buf.data(), BUF_SZ);
+    pos = 0;
+    generated += BUF_SZ;
+  }
+
+  template <typename T>
+  inline T next()
+  {
+    if (pos + sizeof(T) > BUF_SZ)
+      refill();
+    T r;
+    memcpy(&r, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return r;
+  }
+};
+
+inline CtrDrbg &thread_drbg()
+{
+  static thread_local CtrDrbg drbg;
+  return drbg;
+}
+
+// Fills out[0, count) with uniform values in [0, mod), rejecting the words
+// below 2^w mod mod so that the reduction is unbiased
+template <typename W>
+inline void random_ints_w(int64_t *out, size_t count, W mod)
+{
+  CtrDrbg &drbg = thread_drbg();
+  drbg.check_fork();
+  W threshold = (W)(-mod) % mod;
+  for (size_t i = 0; i < count; i++)
+  {
+    W r = drbg.next<W>();
+    while (r < threshold)
+      r = drbg.next<W>();
+    out[i] = (int64_t)(r % mod);
+  }
+}
+
+inline void random_ints(int64_t *out, size_t count, size_t mod)
+{
+  assert(mod > 0 && mod <= (size_t)INT64_MAX + 1);
+  if (mod <= UINT32_MAX)
+    random_ints_w<uint32_t>(out, count, (uint32_t)mod);
+  else
+    random_ints_w<uint64_t>(out, count, (uint64_t)mod);
+}
+
+inline void random_ints(vector<int64_t> &vec, size_t mod)
+{
+  random_ints(vec.data(), vec.size(), mod);
+}
+
 int64_t random_int(size_t mod)
 {
   int64_t r;
-  random_bytes((uint8_t *)&r, sizeof(r));
-  return r % mod;
+  random_ints(&r, 1, mod);
+  return r;
 }
 
-// vector<int64_t> random_ints(size_t num)
-// {
-//   vector<int64_t> r;
-// }
-
 /* -------------------------------------- */
 
 void write(vector<int64_t> &vec, string fpath)
@@ -196,20 +371,202 @@ void read(vector<string> &vec, string fpath)
   }
 }
 
-void write_data(vector<vector<string>> &data, vector<int64_t> &ad, string dirpath)
+/* -------------------------------------- */
+
+/*
+  Binary set file: a SetFileHeader, then count elements of width bytes each
+  (shorter ones NUL-padded), then with SET_HAS_AD count int64_t associated
+  values, starting at the next multiple of 8 bytes.
+*/
+struct SetFileHeader
+{
+  char magic[8];
+  uint64_t count;
+  uint32_t width;
+  uint32_t flags;
+};
+
+static const char SET_MAGIC[8] = {'P', 'Q', 'S', 'E', 'T', '0', '0', '1'};
+static const uint32_t SET_HAS_AD = 1;
+
+inline size_t set_ad_offset(size_t count, size_t width)
+{
+  return (sizeof(SetFileHeader) + (count * width) + 7) & ~(size_t)7;
+}
+
+// Read-only view of a set: X[i] points into the underlying file image
+struct SetView
+{
+  const char *base = nullptr;
+  size_t count = 0, width = 0;
+  const int64_t *ad = nullptr;
+
+  inline size_t size() const
+  {
+    return count;
+  }
+
+  inline string_view operator[](size_t i) const
+  {
+    const char *p = base + (i * width);
+    return string_view(p, strnlen(p, width));
+  }
+};
+
+// Owns the image behind a SetView: either a read-only mapping of a set file
+// or an in-memory copy packed from strings
+struct SetFile
+{
+  SetView view;
+  char *image = nullptr;
+  size_t image_len = 0;
+  bool mapped = false;
+
+  SetFile() {}
+
+  SetFile(const SetFile &) = delete;
+  SetFile &operator=(const SetFile &) = delete;
+
+  SetFile(SetFile &&o) noexcept
+  {
+    *this = move(o);
+  }
+
+  SetFile &operator=(SetFile &&o) noexcept
+  {
+    if (this != &o)
+    {
+      release();
+      view = o.view;
+      image = o.image;
+      image_len = o.image_len;
+      mapped = o.mapped;
+      o.view = SetView();
+      o.image = nullptr;
+      o.image_len = 0;
+    }
+    return *this;
+  }
+
+  ~SetFile()
+  {
+    release();
+  }
+
+  void release()
+  {
+    if (image == nullptr)
+      return;
+    if (mapped)
+      munmap(image, image_len);
+    else
+      free(image);
+    image = nullptr;
+  }
+
+  // Points view into image, checking the header against the image size
+  void attach()
+  {
+    SetFileHeader hdr;
+    if (image_len < sizeof(hdr))
+      throw runtime_error("Set file too short.");
+    memcpy(&hdr, image, sizeof(hdr));
+    if (memcmp(hdr.magic, SET_MAGIC, sizeof(SET_MAGIC)) != 0)
+      throw runtime_error("Not a set file.");
+    size_t len = sizeof(hdr) + (hdr.count * hdr.width);
+    if (hdr.flags & SET_HAS_AD)
+      len = set_ad_offset(hdr.count, hdr.width) + (hdr.count * sizeof(int64_t));
+    if (image_len < len)
+      throw runtime_error("Set file truncated.");
+
+    view.base = image + sizeof(hdr);
+    view.count = hdr.count;
+    view.width = hdr.width;
+    view.ad = (hdr.flags & SET_HAS_AD) ? (const int64_t *)(image + set_ad_offset(hdr.count, hdr.width)) : nullptr;
+  }
+
+  static SetFile open(const string &path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      if (fd >= 0)
+        close(fd);
+      throw runtime_error("Cannot open " + path + ".");
+    }
+    SetFile f;
+    f.image_len = (size_t)st.st_size;
+    void *m = mmap(nullptr, f.image_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+      throw runtime_error("Cannot map " + path + ".");
+    madvise(m, f.image_len, MADV_WILLNEED);
+    f.image = (char *)m;
+    f.mapped = true;
+    f.attach();
+    return f;
+  }
+
+  // ad may be empty
+  static SetFile pack(const vector<string> &X, const vector<int64_t> &ad)
+  {
+    assert(ad.size() == 0 || ad.size() == X.size());
+    size_t width = 0;
+    for (const auto &x : X)
+      width = max(width, x.size());
+
+    SetFileHeader hdr;
+    memcpy(hdr.magic, SET_MAGIC, sizeof(SET_MAGIC));
+    hdr.count = X.size();
+    hdr.width = (uint32_t)width;
+    hdr.flags = (ad.size() > 0) ? SET_HAS_AD : 0;
+
+    SetFile f;
+    f.image_len = (ad.size() > 0) ? set_ad_offset(X.size(), width) + (X.size() * sizeof(int64_t)) : sizeof(hdr) + (X.size() * width);
+    f.image = (char *)calloc(f.image_len, 1);
+    memcpy(f.image, &hdr, sizeof(hdr));
+    for (size_t i = 0; i < X.size(); i++)
+      memcpy(f.image + sizeof(hdr) + (i * width), X[i].data(), X[i].size());
+    if (ad.size() > 0)
+      memcpy(f.image + set_ad_offset(X.size(), width), ad.data(), ad.size() * sizeof(int64_t));
+    f.attach();
+    return f;
+  }
+
+  void write(const string &path) const
+  {
+    ofstream out_file(path, ios::binary);
+    out_file.write(image, image_len);
+  }
+};
+
+/* -------------------------------------- */
+
+void write_data(const vector<SetFile> &sets, string dirpath)
 {
   cout << "Writing data..." << endl;
-  for (size_t i = 0; i < data.size(); i++)
+  for (size_t i = 0; i < sets.size(); i++)
   {
-    string path = dirpath + "/" + to_string(i) + ".dat";
-    write(data[i], path);
+    string path = dirpath + "/" + to_string(i) + ".bin";
+    sets[i].write(path);
     cout << "\tWrote to " << path << "." << endl;
   }
-  if (ad.size() > 0)
-    write(ad, dirpath + "/0-AD.dat");
 }
 
-void read_data(vector<vector<string>> &data, vector<int64_t> &ad, size_t x0, size_t xi, string dirpath, bool with_ad)
+void read_data(vector<SetFile> &sets, string dirpath)
+{
+  cout << "Reading data..." << endl;
+  for (size_t i = 0; i < sets.size(); i++)
+  {
+    string path = dirpath + "/" + to_string(i) + ".bin";
+    sets[i] = SetFile::open(path);
+    cout << "\tMapped " << path << "." << endl;
+  }
+}
+
+// Reads the text layout: one element per line in i.dat, associated data in 0-AD.dat
+void read_dat_data(vector<vector<string>> &data, vector<int64_t> &ad, size_t x0, size_t xi, string dirpath, bool with_ad)
 {
   cout << "Reading data..." << endl;
   for (size_t i = 0; i < data.size(); i++)
@@ -226,16 +583,36 @@ void read_data(vector<vector<string>> &data, vector<int64_t> &ad, size_t x0, siz
   }
 }
 
+// Rewrites the text files of dirpath as set files
+void convert_dat_data(size_t n_parties, size_t x0, size_t xi, string dirpath, bool with_ad)
+{
+  vector<vector<string>> data(n_parties);
+  vector<int64_t> ad, no_ad;
+  read_dat_data(data, ad, x0, xi, dirpath, with_ad);
+  vector<SetFile> sets(n_parties);
+  for (size_t i = 0; i < n_parties; i++)
+    sets[i] = SetFile::pack(data[i], (i == 0) ? ad : no_ad);
+  write_data(sets, dirpath);
+}
+
 /* -------------------------------------- */
 
-size_t get_intersection_size(vector<vector<string>> &data, bool iu)
+size_t get_intersection_size(const vector<SetView> &sets, bool iu)
 {
+  vector<vector<string_view>> data(sets.size());
   size_t max_size = 0;
-  for (size_t i = 1; i < data.size(); i++)
-    max_size += data[i].size();
+  for (size_t i = 0; i < sets.size(); i++)
+  {
+    data[i].resize(sets[i].size());
+    for (size_t j = 0; j < sets[i].size(); j++)
+      data[i][j] = sets[i][j];
+    sort(data[i].begin(), data[i].end());
+    if (i > 0)
+      max_size += data[i].size();
+  }
 
-  vector<string> U(max_size), Uprime(max_size), I(max_size);
-  vector<string>::iterator it;
+  vector<string_view> U(max_size), Uprime(max_size), I(max_size);
+  vector<string_view>::iterator it;
   if (iu)
   {
     it = set_union(data[1].begin(), data[1].end(), data[2].begin(), data[2].end(), U.begin());
@@ -321,8 +698,7 @@ void gen_random_data(vector<vector<string>> &ret, vector<int64_t> &ad, size_t n_
   if (run_sum)
   {
     ad.resize(ret[0].size());
-    for (size_t i = 0; i < ad.size(); i++)
-      ad[i] = random_int(65537);
+    random_ints(ad, 65537);
   }
 
   cout << " generated." << endl;
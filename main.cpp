@@ -1,14 +1,19 @@
 #include <iostream>
 #include <iomanip>
+#include <future>
 #include "crypto.hpp"
 #include "utils.hpp"
 #include "hashmap.hpp"
 #include "argparse.hpp"
 #include "delegate.hpp"
+#include "network.hpp"
+#include "planner.hpp"
+#include <sys/wait.h>
+#include <sys/resource.h>
 
 using namespace std;
 
-void print_parameters(bool iu, bool run_sum, int n, int x0, int xi, int int_sz, int map_sz, string dir, bool v, int nthreads)
+void print_parameters(bool iu, bool run_sum, int n, int x0, int xi, int int_sz, int map_sz, int cuckoo, size_t bin_sz, size_t tag_sz, int stat_sec, string dir, bool v, int nthreads)
 {
   print_sep();
   string protocol = string(iu ? "MPSIU" : "MPSI") + string(run_sum ? "-Sum" : "");
@@ -19,6 +24,9 @@ void print_parameters(bool iu, bool run_sum, int n, int x0, int xi, int int_sz,
   cout << "|X_i|\t\t" << xi << endl;
   cout << "|I|\t\t" << int_sz << endl;
   cout << "|M|\t\t" << map_sz << endl;
+  if (cuckoo > 1)
+    cout << "Cuckoo\t\t" << cuckoo << " hashes, bins of " << bin_sz << endl;
+  cout << "Tag\t\t" << tag_sz << " bytes (false match <= 2^-" << stat_sec << ")" << endl;
   cout << "Threads\t\t" << nthreads << endl;
   cout << "Location\t" << dir << endl;
   cout << "Verbose?\t" << (v ? "True" : "False") << endl;
@@ -42,6 +50,91 @@ size_t run_joint_decryption(Delegate &del, vector<Party> &providers, vector<CT>
   return (size_t)agg_pt->GetCKKSPackedValue()[0].real();
 }
 
+/*
+  MPSI(U) with the providers' shares computed concurrently. MPSI shares are
+  summed pairwise in a log(n)-depth tree; MPSIU masks are private to each
+  provider, so only the cheap mask-and-add fold runs in party order. The last
+  provider randomizes the result as before.
+*/
+void run_tree_aggregation(vector<Party> &providers, Tuple<vector<CT>> &M, Tuple<vector<CT>> &R, vector<SetView> &data, bool iu)
+{
+  Stopwatch sw;
+  print_title(string(iu ? "MPSIU" : "MPSI") + ": Tree Aggregation");
+  sw.start();
+
+  size_t k = providers.size();
+  vector<Share> shares(k);
+  vector<future<double>> done(k);
+  for (size_t i = 0; i < k; i++)
+  {
+    done[i] = async(launch::async, [&providers, &shares, &M, &data, iu, i]
+                    {
+                      Stopwatch t;
+                      t.start();
+                      providers[i].compute_share(&M, data[i + 1], iu, shares[i]);
+                      return t.elapsed(); });
+  }
+  for (size_t i = 0; i < k; i++)
+    printf("Party %lu share: %5.2fs\n", i + 1, done[i].get());
+
+  if (iu)
+  {
+    R.e0 = move(shares[0].ct);
+    for (size_t i = 1; i < k; i++)
+      providers[i].fold_share(R.e0, shares[i]);
+  }
+  else
+  {
+    for (size_t step = 1; step < k; step *= 2)
+    {
+      vector<future<void>> level;
+      for (size_t j = 0; j + step < k; j += 2 * step)
+      {
+        level.push_back(async(launch::async, [&providers, &shares, j, step]
+                              {
+                                providers[j].add_all_inplace(shares[j].ct, shares[j + step].ct);
+                                shares[j + step].ct.clear(); }));
+      }
+      for (auto &f : level)
+        f.get();
+    }
+    R.e0 = move(shares[0].ct);
+  }
+  R.e1 = M.e1;
+  providers[k - 1].randomize_all_inplace(&R);
+
+  printf("\nTime: %5.2fs\n", sw.elapsed());
+}
+
+/*
+  MPSI(U) with providers as pipeline stages over chunks of R: provider i+1
+  starts on a chunk as soon as provider i has finished it, so map setup and
+  computation of all providers overlap.
+*/
+void run_pipelined(vector<Party> &providers, Tuple<vector<CT>> &M, Tuple<vector<CT>> &R, vector<SetView> &data, bool iu, size_t chunk_sz)
+{
+  Stopwatch sw;
+  print_title(string(iu ? "MPSIU" : "MPSI") + ": Pipelined (" + to_string(chunk_sz) + " ciphertexts per chunk)");
+  sw.start();
+
+  size_t k = providers.size();
+  vector<ChunkProgress> progress(k);
+  vector<future<double>> done(k);
+  for (size_t i = 0; i < k; i++)
+  {
+    done[i] = async(launch::async, [&providers, &progress, &M, &R, &data, iu, chunk_sz, i]
+                    {
+                      Stopwatch t;
+                      t.start();
+                      providers[i].compute_on_r_streamed(&M, &R, data[i + 1], iu, chunk_sz, (i == 0) ? nullptr : &progress[i - 1], progress[i]);
+                      return t.elapsed(); });
+  }
+  for (size_t i = 0; i < k; i++)
+    printf("Party %lu done: %5.2fs\n", i + 1, done[i].get());
+
+  printf("\nTime: %5.2fs\n", sw.elapsed());
+}
+
 void run_dkg(Delegate &del, vector<Party> &providers, PK &apk, shared_ptr<EvalKeys> &ask)
 {
   Stopwatch sw;
@@ -86,6 +179,291 @@ void run_dkg(Delegate &del, vector<Party> &providers, PK &apk, shared_ptr<EvalKe
   printf("\nTime: %5.2fs\n", sw.elapsed());
 }
 
+/*
+  Multi-process mode: every party runs in its own process and the parties
+  exchange keys, M, R and partial decryptions over net. Each phase reports
+  the bytes this party put on and took off the wire. The delegate also
+  records each phase's time and bytes in report, under the keys the
+  in-process run uses.
+*/
+void run_delegate_process(Network &net, ProtocolParameters &pro_parms, shared_ptr<CCParams<CryptoContextBFVRNS>> &bfv_parms, shared_ptr<CCParams<CryptoContextCKKSRNS>> &ckks_parms, const SetView &X, vector<int64_t> &ad, bool run_sum, RunReport &report)
+{
+  size_t n = net.n;
+  net.report = &report;
+  net.begin_phase("Setup", "setup");
+  Stopwatch sw;
+  sw.start();
+  Delegate del(pro_parms, bfv_parms, ckks_parms);
+  printf("Startup: %5.2fs (%s)\n", sw.elapsed(), ContextCache::state().c_str());
+  report.add("setup_cache", ContextCache::state());
+  BS::thread_pool &pool = *del.party.pro_parms.pool;
+  for (size_t j = 1; j < n; j++)
+  {
+    send_obj(net.peer(j), del.party.pro_parms.pk);
+    if (pro_parms.num_hash_fns > 1)
+      send_mult_keys(net.peer(j), del.party.bfv_ctx);
+  }
+
+  Stopwatch sw_total;
+  sw_total.start();
+  if (run_sum)
+  {
+    // Key aggregation passes (apk, ask) around the ring 0 -> 1 -> ... -> n-1 -> 0
+    net.begin_phase("Key Aggregation", "dkg");
+    PK apk;
+    shared_ptr<EvalKeys> ask = make_shared<EvalKeys>();
+    del.party.dkg(apk, ask);
+    send_obj(net.peer(1), apk);
+    send_obj(net.peer(1), *ask);
+    recv_obj(net.peer(n - 1), apk);
+    recv_obj(net.peer(n - 1), *ask);
+    del.party.pro_parms.apk = apk;
+    del.party.pro_parms.ask = ask;
+  }
+
+  net.begin_phase("DelegateStart", "delegate_start");
+  Tuple<vector<CT>> M = del.start(X, ad);
+  report.add("num_ct", M.e0.size() + M.e1.size());
+  for (size_t j = 1; j < n; j++)
+  {
+    net.peer(j).send_pod<uint32_t>(del.party.pro_parms.hash_seed);
+    if (pro_parms.sparse)
+      net.peer(j).send_pods(*del.party.pro_parms.ct_pt);
+    send_cts(net.peer(j), M.e0, pool);
+    send_cts(net.peer(j), M.e1, pool);
+  }
+
+  // The delegate waits out the providers until R arrives
+  net.begin_phase("Providers", "providers");
+  Tuple<vector<CT>> R;
+  recv_cts(net.peer(n - 1), R.e0, pool);
+  recv_cts(net.peer(n - 1), R.e1, pool);
+
+  net.begin_phase("DelegateFinish", "delegate_finish");
+  vector<CT> agg_res(1);
+  size_t int_size = del.finish(&R, agg_res);
+  report.add("int_size", int_size);
+  cout << "Computed intersection size: " << int_size << endl;
+
+  if (run_sum)
+  {
+    net.begin_phase("Joint Decryption", "joint_decrypt");
+    for (size_t j = 1; j < n; j++)
+      send_obj(net.peer(j), agg_res[0]);
+    vector<CT> agg_res_parts(n);
+    agg_res_parts[0] = del.party.joint_decrypt(agg_res)[0];
+    for (size_t j = 1; j < n; j++)
+      recv_obj(net.peer(j), agg_res_parts[j]);
+    PT agg_pt = del.joint_decrypt_final(agg_res_parts);
+    agg_pt->SetLength(1);
+    size_t int_sum = (size_t)agg_pt->GetCKKSPackedValue()[0].real();
+    report.add("int_sum", int_sum);
+    cout << "Computed intersection sum: " << setprecision(9) << int_sum << endl;
+  }
+  net.end_phase();
+  report.add("protocol_s", sw_total.elapsed());
+  report.add("sent_mb", (double)net.total_sent() / (1 << 20));
+  report.add("recvd_mb", (double)net.total_recvd() / (1 << 20));
+  net.report = nullptr;
+  printf("Comm [Total]: sent %.2f MB, received %.2f MB\n", (double)net.total_sent() / (1 << 20), (double)net.total_recvd() / (1 << 20));
+}
+
+void run_provider_process(Network &net, ProtocolParameters &pro_parms, shared_ptr<CCParams<CryptoContextBFVRNS>> &bfv_parms, shared_ptr<CCParams<CryptoContextCKKSRNS>> &ckks_parms, const SetView &X, bool iu, bool run_sum)
+{
+  size_t n = net.n, j = net.id;
+  size_t next = (j == n - 1) ? 0 : j + 1;
+  net.begin_phase("Setup");
+  pro_parms.party_id = j;
+  Party party(pro_parms, bfv_parms, ckks_parms);
+  BS::thread_pool &pool = *party.pro_parms.pool;
+  recv_obj(net.peer(0), party.pro_parms.pk);
+  if (pro_parms.num_hash_fns > 1)
+    recv_mult_keys(net.peer(0), party.bfv_ctx);
+
+  if (run_sum)
+  {
+    net.begin_phase("Key Aggregation");
+    PK apk;
+    shared_ptr<EvalKeys> ask = make_shared<EvalKeys>();
+    recv_obj(net.peer(j - 1), apk);
+    recv_obj(net.peer(j - 1), *ask);
+    party.dkg(apk, ask);
+    send_obj(net.peer(next), apk);
+    send_obj(net.peer(next), *ask);
+    party.pro_parms.apk = apk;
+  }
+
+  net.begin_phase("Party " + to_string(j));
+  Tuple<vector<CT>> M, R;
+  party.pro_parms.hash_seed = net.peer(0).recv_pod<uint32_t>();
+  if (pro_parms.sparse)
+  {
+    auto ct_pt = make_shared<vector<size_t>>();
+    net.peer(0).recv_pods(*ct_pt);
+    party.pro_parms.ct_pt = ct_pt;
+  }
+  recv_cts(net.peer(0), M.e0, pool);
+  recv_cts(net.peer(0), M.e1, pool);
+  if (j == 1)
+  {
+    R.e0 = vector<CT>(M.e0.size());
+    R.e1 = vector<CT>(M.e1.size());
+  }
+  else
+  {
+    recv_cts(net.peer(j - 1), R.e0, pool);
+    recv_cts(net.peer(j - 1), R.e1, pool);
+  }
+  party.compute_on_r(&M, &R, X, iu, run_sum);
+  send_cts(net.peer(next), R.e0, pool);
+  send_cts(net.peer(next), R.e1, pool);
+
+  if (run_sum)
+  {
+    net.begin_phase("Joint Decryption");
+    vector<CT> agg_res(1);
+    recv_obj(net.peer(0), agg_res[0]);
+    send_obj(net.peer(0), party.joint_decrypt(agg_res)[0]);
+  }
+  net.end_phase();
+}
+
+// Flags of main that take no value (implicit_value); every other flag is
+// followed by one
+static const set<string> SWITCH_FLAGS = {"--read", "--iu", "--sum", "--in-bits", "--tree", "--v", "--convert", "--sparse", "--plan", "--auto", "--gen"};
+
+/*
+  Scaling sweep: grid is "flag=v1,v2;flag=v1,...", e.g. "t=1,2,4;x0=4096,8192",
+  naming flags of main; a switch is swept with the values 0 and 1. Every point of the grid runs as a fresh
+  pqmpso process with the remaining flags of this invocation; its --report,
+  wall time and peak RSS become one row of out_path, and its output goes to
+  out_path.<run>.log. The CSV is rewritten after every run.
+*/
+int run_sweep(int argc, char *argv[], const string &grid, const string &out_path)
+{
+  vector<pair<string, vector<string>>> axes;
+  stringstream gs(grid);
+  string axis;
+  while (getline(gs, axis, ';'))
+  {
+    size_t eq = axis.find('=');
+    if (eq == string::npos)
+      throw runtime_error("Bad sweep axis " + axis + ".");
+    vector<string> vals;
+    stringstream vs(axis.substr(eq + 1));
+    string v;
+    while (getline(vs, v, ','))
+      vals.push_back(v);
+    if (vals.empty())
+      throw runtime_error("Sweep axis " + axis + " has no values.");
+    axes.push_back({axis.substr(0, eq), vals});
+  }
+
+  // Flags of this invocation, minus the sweep's own and the swept ones
+  set<string> skip = {"--sweep", "--sweep-out", "--report"};
+  for (auto &[name, vals] : axes)
+    skip.insert("--" + name);
+  vector<string> base;
+  for (int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+    string flag = arg.substr(0, arg.find('='));
+    if (skip.count(flag) == 0)
+      base.push_back(arg);
+    else if (flag == arg && SWITCH_FLAGS.count(flag) == 0)
+      i++;
+  }
+
+  vector<string> columns;
+  for (auto &[name, vals] : axes)
+    columns.push_back(name);
+  for (string c : {"status", "wall_s", "peak_rss_mb"})
+    columns.push_back(c);
+  vector<map<string, string>> rows;
+
+  vector<size_t> point(axes.size(), 0);
+  for (size_t run = 0;; run++)
+  {
+    vector<string> args = base;
+    map<string, string> row;
+    for (size_t a = 0; a < axes.size(); a++)
+    {
+      string flag = "--" + axes[a].first, val = axes[a].second[point[a]];
+      if (SWITCH_FLAGS.count(flag) == 0)
+      {
+        args.push_back(flag);
+        args.push_back(val);
+      }
+      else if (val != "0")
+        args.push_back(flag);
+      row[axes[a].first] = val;
+    }
+    string report_path = out_path + "." + to_string(run) + ".report";
+    string log_path = out_path + "." + to_string(run) + ".log";
+    args.push_back("--report");
+    args.push_back(report_path);
+
+    cout << "Sweep run " << run << ":";
+    for (auto &[name, vals] : axes)
+      cout << " " << name << "=" << row[name];
+    cout << endl;
+
+    Stopwatch sw;
+    sw.start();
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      int fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0)
+        _exit(127);
+      close(fd);
+      vector<char *> cargs = {argv[0]};
+      for (auto &s : args)
+        cargs.push_back(s.data());
+      cargs.push_back(nullptr);
+      execv("/proc/self/exe", cargs.data());
+      _exit(127);
+    }
+    int status = 0;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    row["wall_s"] = to_string(sw.elapsed());
+    row["status"] = to_string(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    // ru_maxrss is in KiB on Linux
+    row["peak_rss_mb"] = to_string((double)ru.ru_maxrss / 1024);
+
+    for (auto &[key, val] : RunReport::read(report_path).entries)
+    {
+      if (find(columns.begin(), columns.end(), key) == columns.end())
+        columns.push_back(key);
+      row[key] = val;
+    }
+    remove(report_path.c_str());
+    rows.push_back(row);
+
+    ofstream out(out_path);
+    for (size_t c = 0; c < columns.size(); c++)
+      out << (c ? "," : "") << columns[c];
+    out << endl;
+    for (auto &r : rows)
+    {
+      for (size_t c = 0; c < columns.size(); c++)
+        out << (c ? "," : "") << r[columns[c]];
+      out << endl;
+    }
+
+    // Next grid point, last axis fastest
+    size_t a = axes.size();
+    while (a > 0 && ++point[a - 1] == axes[a - 1].second.size())
+      point[--a] = 0;
+    if (a == 0)
+      break;
+  }
+  cout << "Sweep results written to " << out_path << endl;
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   argparse::ArgumentParser program("Post-Quantum Secure MPSIU");
@@ -131,6 +509,21 @@ int main(int argc, char *argv[])
       .help("size of the hashmap")
       .scan<'i', int>();
 
+  program.add_argument("--cuckoo")
+      .default_value(0)
+      .help("number of cuckoo hash functions, sizes the map automatically (0 = plain hashing)")
+      .scan<'i', int>();
+
+  program.add_argument("--tree")
+      .help("compute provider shares concurrently and aggregate them in a tree")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--chunk")
+      .help("pipeline providers over chunks of this many ciphertexts (0 = off)")
+      .default_value(0)
+      .scan<'i', int>();
+
   program.add_argument("--dir")
       .help("data directory")
       .default_value(string("./data"));
@@ -149,6 +542,94 @@ int main(int argc, char *argv[])
       .help("number of threads to use")
       .scan<'i', int>();
 
+  program.add_argument("--convert")
+      .help("convert the text .dat files in --dir to binary set files and exit")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--net")
+      .help("run each party as its own process over unix:<prefix> or tcp:<host>:<port>")
+      .default_value(string(""));
+
+  program.add_argument("--role")
+      .help("with --net, run only this party (0 = delegate); by default all parties are forked")
+      .default_value(-1)
+      .scan<'i', int>();
+
+  program.add_argument("--cache")
+      .help("directory to keep crypto contexts and delegate keys in across runs")
+      .default_value(string(""));
+
+  program.add_argument("--offline")
+      .help("precompute this many encryptions of zero into --cache and exit")
+      .default_value(0)
+      .scan<'i', int>();
+
+  program.add_argument("--trace")
+      .help("write a Chrome trace of the protocol phases to this file (and a summary to <file>.summary.json)")
+      .default_value(string(""));
+
+  program.add_argument("--sweep")
+      .help("run every point of a flag grid, e.g. \"t=1,4;x0=4096,8192\", as its own process")
+      .default_value(string(""));
+
+  program.add_argument("--sweep-out")
+      .help("CSV file for --sweep results")
+      .default_value(string("sweep.csv"));
+
+  program.add_argument("--report")
+      .help("write per-phase times and counts of this run to this file")
+      .default_value(string(""));
+
+  program.add_argument("--mem-budget")
+      .help("memory budget in MB; plaintexts are then built in chunks of M that fit it (0 = no limit)")
+      .default_value(0)
+      .scan<'i', int>();
+
+  program.add_argument("--ct-store")
+      .help("keep M and R on disk in this directory, in segments of the --mem-budget chunk")
+      .default_value(string(""));
+
+  program.add_argument("--tag")
+      .help("tag length in bytes, at most 48 (0 = shortest that meets --fp)")
+      .default_value(0)
+      .scan<'i', int>();
+
+  program.add_argument("--fp")
+      .help("bound the chance of any false match by 2^-fp when sizing tags")
+      .default_value(40)
+      .scan<'i', int>();
+
+  program.add_argument("--pt-bits")
+      .help("tag bits per BFV coefficient; the plaintext modulus is the smallest batching prime above 2^pt-bits")
+      .default_value(16)
+      .scan<'i', int>();
+
+  program.add_argument("--sparse")
+      .help("send only the ciphertexts of M that hold delegate elements; reveals to the providers which ones do")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--ring")
+      .help("ring dimension")
+      .default_value(32768)
+      .scan<'i', int>();
+
+  program.add_argument("--sec")
+      .help("security level in bits (128, 192 or 256)")
+      .default_value(192)
+      .scan<'i', int>();
+
+  program.add_argument("--plan")
+      .help("calibrate, print the fastest ring, modulus, tag, map and packing for this run, and exit")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--auto")
+      .help("run with the configuration --plan would choose; flags given explicitly are kept")
+      .default_value(false)
+      .implicit_value(true);
+
   program.add_argument("--gen")
       .help("generate random data and exit, do NOT run the protocol")
       .default_value(false)
@@ -164,6 +645,13 @@ int main(int argc, char *argv[])
     cerr << program;
     exit(1);
   }
+  // Flags that cannot be used together are reported like parse errors
+  auto usage_error = [&program](const string &msg)
+  {
+    cerr << msg << endl;
+    cerr << program;
+    exit(1);
+  };
 
   auto read = program.get<bool>("--read");
   auto iu = program.get<bool>("--iu");
@@ -176,9 +664,41 @@ int main(int argc, char *argv[])
   auto dir = program.get<string>("--dir");
   auto v = program.get<bool>("--v");
   auto gen_only = program.get<bool>("--gen");
+  auto convert = program.get<bool>("--convert");
+  auto net_addr = program.get<string>("--net");
+  auto cache_dir = program.get<string>("--cache");
+  auto offline = program.get<int>("--offline");
+  auto role = program.get<int>("--role");
+  auto trace_path = program.get<string>("--trace");
+  auto sweep = program.get<string>("--sweep");
+  auto sweep_out = program.get<string>("--sweep-out");
+  auto report_path = program.get<string>("--report");
+  auto mem_budget = program.get<int>("--mem-budget");
+  auto ct_store = program.get<string>("--ct-store");
+  auto tag = program.get<int>("--tag");
+  auto stat_sec = program.get<int>("--fp");
+  auto pt_bits = program.get<int>("--pt-bits");
+  auto ring = program.get<int>("--ring");
+  auto sec = program.get<int>("--sec");
+  auto plan = program.get<bool>("--plan");
+  auto auto_plan = program.get<bool>("--auto");
+  auto sparse = program.get<bool>("--sparse");
+
+  if (sweep != "")
+    return run_sweep(argc, argv, sweep, sweep_out);
   auto pack_type_str = program.get<string>("--pack");
   auto nthreads = program.get<int>("--t");
   auto in_bits = program.get<bool>("--in-bits");
+  auto cuckoo = program.get<int>("--cuckoo");
+  auto tree = program.get<bool>("--tree");
+  auto chunk = program.get<int>("--chunk");
+  if (tree && chunk > 0)
+    usage_error("--tree and --chunk are different provider schedules; use one of them.");
+  // The concurrent schedules keep all plaintexts of a provider at once
+  if (mem_budget > 0 && (tree || chunk > 0))
+    usage_error("--mem-budget applies to the sequential protocol only; drop --tree and --chunk.");
+  if (ct_store != "" && (tree || chunk > 0))
+    usage_error("--ct-store applies to the sequential protocol only; drop --tree and --chunk.");
 
   if (in_bits)
   {
@@ -195,36 +715,182 @@ int main(int argc, char *argv[])
   else if (pack_type_str == "single")
     pack_type = SINGLE;
 
-  print_parameters(iu, run_sum, n, x0, xi, int_sz, map_sz, dir, v, nthreads);
+  if (tag < 0 || tag > (int)MAX_TAG_BYTES)
+    usage_error("--tag must be between 0 and " + to_string(MAX_TAG_BYTES) + ".");
 
-  vector<vector<string>> data(n);
-  vector<int64_t> ad;
+  // The planner chooses whatever the user left open
+  if (plan || auto_plan)
+  {
+    PlanSpace space;
+    if (program.is_used("--ring"))
+      space.ring_dims = {(size_t)ring};
+    if (program.is_used("--pt-bits"))
+      space.pt_bits = {(size_t)pt_bits};
+    if (program.is_used("--cuckoo"))
+      space.hash_fns = {(size_t)max(cuckoo, 1)};
+    if (program.is_used("--pack"))
+      space.packs = {pack_type};
+    PlanRequest req = {(size_t)n, (size_t)x0, (size_t)xi, (size_t)map_sz, (size_t)nthreads, (size_t)stat_sec, (size_t)tag, iu, run_sum, sparse};
+    set_ctx_cache_dir(cache_dir);
+    vector<PlanConfig> configs = plan_run(req, space, security_level(sec));
+    print_plan(configs);
+    if (plan)
+      return 0;
+    if (configs.empty())
+      usage_error("No configuration fits this run.");
+    const PlanConfig &best = configs[0];
+    ring = (int)best.ring_dim;
+    pt_bits = (int)best.pt_bits;
+    tag = (int)best.tag_sz;
+    cuckoo = (best.num_hash_fns > 1) ? (int)best.num_hash_fns : 0;
+    pack_type = best.pack_type;
+  }
 
+  size_t bin_sz = 1, bfv_depth = 1;
+  if (cuckoo > 1)
+  {
+    map_sz = (int)cuckoo_map_size(cuckoo, x0);
+    bin_sz = max_bin_load((size_t)cuckoo * xi, map_sz);
+    bfv_depth += (size_t)ceil(log2((double)bin_sz));
+  }
+  size_t tag_sz = (size_t)tag;
+  if (tag == 0)
+  {
+    try
+    {
+      tag_sz = tag_bytes_for(map_sz, n, bin_sz, stat_sec);
+    }
+    catch (const runtime_error &err)
+    {
+      usage_error(err.what());
+    }
+  }
+  // A given tag may be shorter than --fp asks for; print the bound it meets
+  size_t tag_bits = tag_bits_for(map_sz, n, bin_sz, stat_sec);
+  if (tag_sz * 8 < tag_bits)
+    stat_sec = max(stat_sec - (int)(tag_bits - (tag_sz * 8)), 0);
+
+  print_parameters(iu, run_sum, n, x0, xi, int_sz, map_sz, cuckoo, bin_sz, tag_sz, stat_sec, dir, v, nthreads);
+
+  if (convert)
+  {
+    convert_dat_data(n, x0, xi, dir, run_sum);
+    exit(0);
+  }
+
+  vector<SetFile> sets(n);
   if (read)
-    read_data(data, ad, x0, xi, dir, run_sum);
+    read_data(sets, dir);
   else
-    gen_random_data(data, ad, n, x0, xi, int_sz, iu, run_sum);
+  {
+    vector<vector<string>> gen(n);
+    vector<int64_t> gen_ad, no_ad;
+    gen_random_data(gen, gen_ad, n, x0, xi, int_sz, iu, run_sum);
+    for (int i = 0; i < n; i++)
+      sets[i] = SetFile::pack(gen[i], (i == 0) ? gen_ad : no_ad);
+  }
+
+  vector<SetView> data(n);
+  for (int i = 0; i < n; i++)
+  {
+    data[i] = sets[i].view;
+    assert(data[i].size() == (size_t)((i == 0) ? x0 : xi));
+  }
+  vector<int64_t> ad;
+  if (run_sum)
+  {
+    assert(data[0].ad != nullptr);
+    ad.assign(data[0].ad, data[0].ad + data[0].size());
+  }
 
-  cout << int_sz << " " << get_intersection_size(data, iu) << endl;
-  assert((size_t)int_sz == get_intersection_size(data, iu));
+  size_t computed_int_sz = get_intersection_size(data, iu);
+  cout << int_sz << " " << computed_int_sz << endl;
+  assert((size_t)int_sz == computed_int_sz);
 
   if (!read)
-    write_data(data, ad, dir);
+    write_data(sets, dir);
 
   print_sep();
 
   if (gen_only)
     exit(0);
 
+  if (trace_path != "")
+    Tracer::enable();
+
   /* Parameter Generation */
-  size_t ring_dim = 32768;
-  shared_ptr<CCParams<CryptoContextBFVRNS>> bfv_parms = gen_bfv_params(ring_dim);
-  shared_ptr<CCParams<CryptoContextCKKSRNS>> ckks_parms = gen_ckks_params(ring_dim);
-  ProtocolParameters pro_parms = {0, (size_t)n, (size_t)map_sz, 48, (size_t)nthreads, n_hashes_in_pt(pack_type, ring_dim, 16, 384), run_sum, pack_type, nullptr, nullptr};
+  set_ctx_cache_dir(cache_dir);
+  size_t ring_dim = (size_t)ring;
+  uint64_t plain_mod = bfv_plain_modulus(ring_dim, (size_t)pt_bits);
+  shared_ptr<CCParams<CryptoContextBFVRNS>> bfv_parms = gen_bfv_params(ring_dim, bfv_depth, plain_mod, security_level(sec));
+  shared_ptr<CCParams<CryptoContextCKKSRNS>> ckks_parms = gen_ckks_params(ring_dim, security_level(sec));
+  size_t batch_size = n_hashes_in_pt(pack_type, ring_dim, plain_mod_bits(plain_mod), tag_sz * 8);
+  // MPSI-Sum weights one CKKS slot per hash
+  if (run_sum && batch_size > ring_dim / 2)
+    throw runtime_error("Tags of " + to_string(tag_sz) + " bytes pack more hashes per plaintext than CKKS has slots.");
+  ProtocolParameters pro_parms = {0, (size_t)n, (size_t)map_sz, tag_sz, (size_t)nthreads, batch_size, run_sum, pack_type, nullptr, nullptr};
+  pro_parms.num_hash_fns = max(cuckoo, 1);
+  pro_parms.bin_sz = bin_sz;
+  pro_parms.sparse = sparse;
+
+  if (net_addr != "")
+  {
+    // The process protocol is the sequential one
+    if (tree || chunk > 0)
+      usage_error("--tree and --chunk are not supported with --net.");
+    // The delegate process takes precomputed zeros from --cache; fill it first
+    if (offline > 0)
+      usage_error("--offline runs without --net; the --net delegate then uses the precomputed encryptions in --cache.");
+    if (mem_budget > 0 || ct_store != "")
+      usage_error("--mem-budget and --ct-store are not supported with --net.");
+
+    // Fork before any pool threads exist; every process builds its own
+    bool forked = (role < 0);
+    vector<pid_t> children;
+    if (forked)
+    {
+      cout.flush();
+      fflush(stdout);
+      role = 0;
+      for (int i = 1; i < n; i++)
+      {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+          role = i;
+          children.clear();
+          break;
+        }
+        children.push_back(pid);
+      }
+    }
+    pro_parms.pool = make_shared<BS::thread_pool>(nthreads);
+    RunReport report;
+    {
+      Network net((size_t)role, (size_t)n, net_addr);
+      if (role == 0)
+        run_delegate_process(net, pro_parms, bfv_parms, ckks_parms, data[0], ad, run_sum, report);
+      else
+        run_provider_process(net, pro_parms, bfv_parms, ckks_parms, data[role], iu, run_sum);
+    }
+    if (trace_path != "")
+      Tracer::write(trace_path + "." + to_string(role));
+    for (pid_t pid : children)
+      waitpid(pid, nullptr, 0);
+    if (role == 0 && report_path != "")
+      report.write(report_path);
+    return 0;
+  }
+
+  pro_parms.pool = make_shared<BS::thread_pool>(nthreads);
 
   /* Setup */
+  Stopwatch sw_setup;
+  sw_setup.start();
+  reset_peak_rss();
   Delegate del(pro_parms, bfv_parms, ckks_parms);
   vector<Party> providers(n - 1);
+  bool on_disk = (ct_store != "");
 
   pro_parms.pk = del.party.pro_parms.pk;
   pro_parms.ek = del.party.pro_parms.ek;
@@ -233,33 +899,134 @@ int main(int argc, char *argv[])
     pro_parms.party_id = i + 1;
     providers[i] = Party(pro_parms, bfv_parms, ckks_parms);
   }
+  double t_setup = sw_setup.elapsed();
+  printf("Startup: %5.2fs (%s)\n", t_setup, ContextCache::state().c_str());
+
+  // Every phase reports its time and its own peak RSS
+  RunReport report;
+  Stopwatch sw_phase, sw_total;
+  auto begin_phase = [&sw_phase]()
+  {
+    sw_phase.start();
+    reset_peak_rss();
+  };
+  auto end_phase = [&sw_phase, &report](const string &name)
+  {
+    double peak = peak_rss_mb();
+    printf("Peak RSS [%s]: %.1f MB\n", name.c_str(), peak);
+    report.add(name + "_s", sw_phase.elapsed());
+    report.add(name + "_peak_mb", peak);
+  };
+  report.add("setup_s", t_setup);
+  report.add("setup_cache", ContextCache::state());
+  report.add("setup_peak_mb", peak_rss_mb());
+  sw_total.start();
+
+  if (offline > 0)
+  {
+    del.precompute_zeros((size_t)offline);
+    if (trace_path != "")
+      Tracer::write(trace_path);
+    return 0;
+  }
 
   /* Key Aggregation */
   PK apk;
   shared_ptr<EvalKeys> ask = make_shared<EvalKeys>();
   EvalKey<DCRTPoly> aak;
   if (run_sum)
+  {
+    begin_phase();
     run_dkg(del, providers, apk, ask);
+    end_phase("dkg");
+  }
 
-  /* Delegate Finish */
-  Tuple<vector<CT>> M = del.start(data[0], ad);
+  /* Delegate Start */
+  // With --ct-store, M and R live in segment files and the vectors stay empty
+  Tuple<CtStore> M_store, R_store;
+  Tuple<vector<CT>> M;
+  begin_phase();
+  {
+    // The map is built first: with --sparse it decides how many ciphertexts
+    // M has, which the memory budget is sized for
+    HashMap del_map = del.build_map(data[0], ad);
+
+    // Sized after key aggregation, since MPSI-Sum measures a CKKS ciphertext
+    // under the aggregate key
+    if (mem_budget > 0)
+    {
+      pro_parms.chunk_ct = del.party.chunk_for_budget((size_t)mem_budget << 20, on_disk);
+      del.party.pro_parms.chunk_ct = pro_parms.chunk_ct;
+      for (int i = 0; i < n - 1; i++)
+        providers[i].pro_parms.chunk_ct = pro_parms.chunk_ct;
+      cout << "Ciphertexts per chunk: " << pro_parms.chunk_ct << endl;
+    }
+
+    if (on_disk)
+    {
+      mkdir(ct_store.c_str(), 0700);
+      size_t seg_ct = (pro_parms.chunk_ct > 0) ? pro_parms.chunk_ct : CtStore::DEFAULT_SEG_CT;
+      M_store = {CtStore(ct_store + "/M0", 0, seg_ct), CtStore(ct_store + "/M1", 0, seg_ct)};
+    }
+    M = del.start(del_map, on_disk ? &M_store : nullptr);
+  }
+  end_phase("delegate_start");
+  if (on_disk)
+  {
+    R_store = {CtStore(ct_store + "/R0", M_store.e0.count, M_store.e0.seg_ct), CtStore(ct_store + "/R1", M_store.e1.count, M_store.e1.seg_ct)};
+    report.add("num_ct", M_store.e0.count + M_store.e1.count);
+  }
+  else
+    report.add("num_ct", M.e0.size() + M.e1.size());
+  for (int i = 0; i < n - 1; i++)
+  {
+    providers[i].pro_parms.hash_seed = del.party.pro_parms.hash_seed;
+    providers[i].pro_parms.ct_pt = del.party.pro_parms.ct_pt;
+  }
 
   /* Main Protocol */
   Tuple<vector<CT>> R;
   R.e0 = vector<CT>(M.e0.size());
   R.e1 = vector<CT>(M.e1.size());
-  for (int i = 0; i < n - 1; i++)
-    providers[i].compute_on_r(&M, &R, data[i + 1], iu, run_sum);
+  begin_phase();
+  if (on_disk)
+  {
+    for (int i = 0; i < n - 1; i++)
+      providers[i].compute_on_r_store(M_store, R_store, data[i + 1], iu, run_sum);
+  }
+  else if (tree)
+    run_tree_aggregation(providers, M, R, data, iu);
+  else if (chunk > 0)
+    run_pipelined(providers, M, R, data, iu, (size_t)chunk);
+  else
+  {
+    for (int i = 0; i < n - 1; i++)
+      providers[i].compute_on_r(&M, &R, data[i + 1], iu, run_sum);
+  }
+  end_phase("providers");
 
   vector<CT> agg_res(1);
   /* Delegate Finish */
-  size_t int_size = del.finish(&R, agg_res);
+  begin_phase();
+  size_t int_size = on_disk ? del.finish(R_store, agg_res) : del.finish(&R, agg_res);
+  end_phase("delegate_finish");
+  report.add("int_size", int_size);
   cout << "Computed intersection size: " << int_size << endl;
   if (run_sum)
   {
     /* Joint Decryption */
+    begin_phase();
     size_t int_sum = run_joint_decryption(del, providers, agg_res);
+    end_phase("joint_decrypt");
+    report.add("int_sum", int_sum);
     cout << "Computed intersection sum: " << setprecision(9) << int_sum << endl;
   }
+  report.add("protocol_s", sw_total.elapsed());
+  for (CtStore *s : {&M_store.e0, &M_store.e1, &R_store.e0, &R_store.e1})
+    s->remove_all();
+  if (report_path != "")
+    report.write(report_path);
+  if (trace_path != "")
+    Tracer::write(trace_path);
   return 0;
 }
\ No newline at end of file
@@ -1,8 +1,12 @@
 #include <iostream>
 #include <algorithm>
+#include <sys/wait.h>
 
 #include "ut.hpp"
 #include "crypto.hpp"
+#include "hashmap.hpp"
+#include "ctstore.hpp"
+#include "planner.hpp"
 
 #include "openfhe.h"
 
@@ -113,6 +117,18 @@ void pack_bitwise_vertical(CryptoContext<DCRTPoly> &bfv_ctx, vector<PT> &pts, ve
     pts[i] = bfv_ctx->MakePackedPlaintext(bit_vec[i]);
 }
 
+// A fresh file under /tmp named after stem, so concurrent runs never collide;
+// the caller removes it
+string temp_path(const string &stem)
+{
+  string path = "/tmp/pqmpso_" + stem + "_XXXXXX";
+  int fd = mkstemp(path.data());
+  if (fd < 0)
+    throw runtime_error("Cannot create a file for " + path + ".");
+  close(fd);
+  return path;
+}
+
 int main()
 {
   CCParams<CryptoContextCKKSRNS> enc_params;
@@ -142,6 +158,500 @@ int main()
     ctx->EvalFastRotationPrecompute(ct);
   };
 
+  "SlotHash"_test = []
+  {
+    ProtocolParameters pro_parms = {0, 2, 256, 48, 4, 1, false, MULTIPLE_COMPACT, nullptr, nullptr};
+    HashMap hm(pro_parms);
+    Sha3Hasher hasher;
+    vector<string> X = random_strings(1024);
+    hm.insert(X);
+
+    size_t len = hm.slot_hash_len();
+    vector<vector<uint8_t>> h(X.size(), vector<uint8_t>(len));
+    for (size_t i = 0; i < X.size(); i++)
+      hm.slot_hash(hasher, X[i], h[i].data());
+
+    for (size_t i = 0; i < X.size(); i++)
+    {
+      // Index and tag are disjoint segments of one SHAKE256 output
+      vector<uint8_t> full(len + 16);
+      hasher.xof(X[i], HashMap::SLOT_DOMAIN, full.data(), full.size());
+      expect(memcmp(full.data(), h[i].data(), len) == 0);
+      expect(hm.get_map_index(X[i]) == hm.map_index_from_digest(h[i].data()));
+
+      // Domain-separated from the undecorated XOF and from SHA3-384
+      vector<uint8_t> plain(len);
+      hasher.xof(X[i], "", plain.data(), len);
+      expect(memcmp(plain.data(), h[i].data(), len) != 0);
+      vector<uint8_t> d(SHA384_DIGEST_LENGTH);
+      hasher.digest(X[i], HashMap::SLOT_DOMAIN, d.data());
+      expect(memcmp(d.data(), h[i].data() + sizeof(size_t), hm.sz) != 0);
+    }
+
+    // Elements that share a slot must still have distinct tags
+    size_t n_collisions = 0;
+    for (size_t i = 0; i < X.size(); i++)
+    {
+      for (size_t j = i + 1; j < X.size(); j++)
+      {
+        if (hm.map_index_from_digest(h[i].data()) != hm.map_index_from_digest(h[j].data()))
+          continue;
+        n_collisions++;
+        expect(memcmp(h[i].data() + sizeof(size_t), h[j].data() + sizeof(size_t), hm.sz) != 0);
+      }
+    }
+    expect(n_collisions > 0_ul);
+
+    // The last element mapped to a slot owns it
+    vector<bool> seen(hm.n, false);
+    for (size_t i = X.size(); i-- > 0;)
+    {
+      size_t idx = hm.map_index_from_digest(h[i].data());
+      if (seen[idx])
+        continue;
+      seen[idx] = true;
+      expect(hm.data.is_used(idx));
+      expect(memcmp(hm.data.slot(idx), h[i].data() + sizeof(size_t), hm.sz) == 0);
+    }
+  };
+
+  "Cuckoo"_test = []
+  {
+    size_t set_sz = 4096, k = 3;
+    ProtocolParameters pro_parms = {0, 2, cuckoo_map_size(k, set_sz), 48, 4, 1, false, MULTIPLE_COMPACT, nullptr, nullptr};
+    pro_parms.num_hash_fns = k;
+    pro_parms.bin_sz = max_bin_load(k * set_sz, pro_parms.map_sz);
+    vector<string> X = random_strings(set_sz);
+
+    // Delegate: every element sits at exactly one of its candidate slots
+    HashMap del_hm(pro_parms);
+    vector<int64_t> ad;
+    pro_parms.hash_seed = del_hm.insert_cuckoo(X, ad);
+    expect(del_hm.data.n_used() == set_sz);
+
+    vector<size_t> idx;
+    vector<uint8_t> tags;
+    del_hm.hash_all(X, idx, tags);
+    for (size_t i = 0; i < set_sz; i++)
+    {
+      size_t n_found = 0;
+      for (size_t c = 0; c < k; c++)
+      {
+        size_t slot = idx[i * k + c];
+        if (del_hm.data.is_used(slot) && memcmp(del_hm.data.slot(slot), tags.data() + (i * del_hm.sz), del_hm.sz) == 0)
+          n_found++;
+      }
+      expect(n_found >= 1_ul);
+    }
+
+    // Provider: each delegate slot's tag is in the provider's bin for that slot
+    HashMap prov_hm(pro_parms);
+    prov_hm.insert_bins(X);
+    for (size_t slot = 0; slot < prov_hm.n; slot++)
+    {
+      if (!del_hm.data.is_used(slot))
+        continue;
+      bool found = memcmp(prov_hm.data.slot(slot), del_hm.data.slot(slot), prov_hm.sz) == 0;
+      for (size_t b = 1; b < prov_hm.bin_load[slot] && !found; b++)
+        found = memcmp(prov_hm.bin_tags.data() + ((prov_hm.bin_offset[slot] + b - 1) * prov_hm.sz), del_hm.data.slot(slot), prov_hm.sz) == 0;
+      expect(found);
+    }
+  };
+
+  "RandomInts"_test = []
+  {
+    size_t ring_dim = 32768, plain_mod = 65537, reps = 8;
+    vector<int64_t> int_vec(ring_dim);
+
+    // Range and a coarse uniformity check over 16 buckets
+    vector<size_t> buckets(16, 0);
+    for (size_t r = 0; r < reps; r++)
+    {
+      random_ints(int_vec, plain_mod);
+      for (auto x : int_vec)
+      {
+        expect(x >= 0_ll && x < (int64_t)plain_mod);
+        buckets[(x * 16) / plain_mod]++;
+      }
+    }
+    double expected = (double)(reps * ring_dim) / 16;
+    for (auto b : buckets)
+      expect(fabs((double)b - expected) < 0.05 * expected);
+
+    vector<int64_t> wide(1024);
+    random_ints(wide, (1ULL << 40) + 15);
+    for (auto x : wide)
+      expect(x >= 0_ll && x < (int64_t)((1ULL << 40) + 15));
+
+    // A forked child must not repeat the parent's keystream
+    vector<int64_t> mine(8), theirs(8);
+    int fds[2];
+    expect(pipe(fds) == 0_i);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      random_ints(mine, 1ULL << 40);
+      ssize_t w = write(fds[1], mine.data(), mine.size() * sizeof(int64_t));
+      _exit(w == (ssize_t)(mine.size() * sizeof(int64_t)) ? 0 : 1);
+    }
+    random_ints(mine, 1ULL << 40);
+    expect(read(fds[0], theirs.data(), theirs.size() * sizeof(int64_t)) == (ssize_t)(theirs.size() * sizeof(int64_t)));
+    waitpid(pid, nullptr, 0);
+    close(fds[0]);
+    close(fds[1]);
+    expect(mine != theirs);
+
+    // Against the previous one-RAND_bytes-call-per-coefficient path
+    Stopwatch sw;
+    sw.start();
+    for (size_t r = 0; r < reps; r++)
+    {
+      for (size_t i = 0; i < ring_dim; i++)
+      {
+        int64_t x;
+        random_bytes((uint8_t *)&x, sizeof(x));
+        int_vec[i] = x % (int64_t)plain_mod;
+      }
+    }
+    double t_old = sw.elapsed();
+    sw.start();
+    for (size_t r = 0; r < reps; r++)
+      random_ints(int_vec, plain_mod);
+    double t_new = sw.elapsed();
+    printf("Sampling %lu x %lu coefficients: per-call %5.3fs, bulk %5.3fs\n", reps, ring_dim, t_old, t_new);
+  };
+
+  "ZeroRuns"_test = []
+  {
+    size_t ring_dim = 32768, batch_size = 1365, stride = ring_dim / batch_size, run = 24;
+    vector<int64_t> cf(ring_dim);
+    random_ints(cf, 65537);
+    // Zero out every third hash, and all but one coefficient of every fifth
+    for (size_t j = 0; j < batch_size; j++)
+    {
+      if (j % 3 == 0 || j % 5 == 0)
+        fill(cf.begin() + (j * stride), cf.begin() + (j * stride + run), 0);
+      if (j % 5 == 0 && j % 3 != 0)
+        cf[j * stride + (j % run)] = 1 + (int64_t)(j % 7);
+    }
+
+    size_t words = (batch_size + 63) / 64;
+    vector<uint64_t> expected(words, 0), got(words, 0);
+    zero_runs_scalar(cf.data(), batch_size, stride, run, expected.data());
+    for (size_t j = 0; j < batch_size; j++)
+      expect(((expected[j / 64] >> (j % 64)) & 1) == (j % 3 == 0));
+
+    zero_runs(cf.data(), batch_size, stride, run, got.data());
+    expect(got == expected);
+#if defined(__x86_64__)
+    for (size_t r : {run, (size_t)13, (size_t)5})
+    {
+      vector<uint64_t> ref(words, 0), simd(words, 0);
+      zero_runs_scalar(cf.data(), batch_size, stride, r, ref.data());
+      if (__builtin_cpu_supports("avx2"))
+      {
+        zero_runs_avx2(cf.data(), batch_size, stride, r, simd.data());
+        expect(simd == ref);
+      }
+      if (__builtin_cpu_supports("avx512f"))
+      {
+        fill(simd.begin(), simd.end(), 0);
+        zero_runs_avx512(cf.data(), batch_size, stride, r, simd.data());
+        expect(simd == ref);
+      }
+    }
+#endif
+  };
+
+  "TagBytes"_test = []
+  {
+    // 2^24 slots and 3 providers: 40 + 26 bits, rounded up to 10 bytes
+    expect(tag_bytes_for(1 << 24, 4, 1, 40) == 10);
+    expect(tag_bytes_for(1 << 20, 2, 1, 40) == 8);
+    expect(tag_bytes_for(1 << 24, 4, 8, 40) == 10);
+    expect(tag_bits_for(1 << 24, 4, 1, 40) == 66);
+    // No tag within the maximum meets a 2^-400 bound
+    expect(throws([]
+                  { tag_bytes_for(1 << 24, 4, 1, 400); }));
+    for (size_t map_sz : {1 << 10, 1 << 16, 1 << 24})
+    {
+      size_t bytes = tag_bytes_for(map_sz, 4, 1, 40);
+      expect(bytes % 2 == 0);
+      expect(8 * bytes >= 40 + log2((double)map_sz * 3));
+      // Compact packing gives each hash exactly bytes / 2 coefficients
+      size_t batch_size = n_hashes_in_pt(MULTIPLE_COMPACT, 32768, 16, bytes * 8);
+      expect(32768 / batch_size == bytes / 2);
+    }
+  };
+
+  "SparseMap"_test = []
+  {
+    size_t map_sz = 1 << 20, batch_size = 1365;
+    ProtocolParameters pro_parms = {0, 2, map_sz, 10, 4, batch_size, false, MULTIPLE_COMPACT, nullptr, nullptr};
+    HashMap hm(pro_parms);
+    hm.insert(random_strings(200));
+    expect(hm.n_ciphertexts(batch_size) == hm.n_plaintexts(batch_size));
+    expect(hm.pt_of(7) == 7);
+
+    vector<size_t> occupied = hm.occupied_plaintexts(batch_size);
+    set<size_t> expected;
+    for (size_t j = 0; j < map_sz; j++)
+    {
+      if (hm.data.is_used(j))
+        expected.insert(j / batch_size);
+    }
+    expect(occupied == vector<size_t>(expected.begin(), expected.end()));
+    expect(occupied.size() <= 200);
+
+    // Providers given the delegate's list address the same plaintexts
+    pro_parms.ct_pt = make_shared<const vector<size_t>>(occupied);
+    HashMap provider(pro_parms);
+    expect(provider.n_ciphertexts(batch_size) == occupied.size());
+    for (size_t k = 0; k < occupied.size(); k++)
+      expect(provider.pt_of(k) == occupied[k]);
+  };
+
+  "PlainModulus"_test = []
+  {
+    expect(bfv_plain_modulus(32768, 16) == 65537);
+    expect(plain_mod_bits(65537) == 16);
+    expect(!is_prime_u64(4294967297));
+    expect(bfv_plain_modulus(32768, 30) == 1073872897);
+    for (size_t bits : {20, 30, 45, 60})
+    {
+      uint64_t p = bfv_plain_modulus(32768, bits);
+      expect(is_prime_u64(p));
+      expect(p % 65536 == 1);
+      expect(plain_mod_bits(p) == bits);
+    }
+    // None between 2^17 and 2^18 is 1 mod 2^16
+    expect(throws([]
+                  { bfv_plain_modulus(32768, 17); }));
+    expect(throws([]
+                  { bfv_plain_modulus(32768, 15); }));
+
+    // 48-byte tags: 24 coefficients of 16 bits, 7 of 60
+    expect(n_hashes_in_pt(MULTIPLE_COMPACT, 32768, 16, 384) == 1365);
+    expect(n_hashes_in_pt(MULTIPLE_COMPACT, 32768, 60, 384) == 4681);
+
+    // Packing round trip, with coefficients read back centered mod p
+    for (size_t bits : {16, 20, 30, 60})
+    {
+      uint64_t p = bfv_plain_modulus(32768, bits);
+      vector<uint8_t> tag(48), back(48);
+      random_bytes(tag.data(), tag.size());
+      size_t n_cf = compact_cf_count(tag.size() * 8, bits);
+      vector<int64_t> cf(n_cf);
+      pack_compact_int_arr(&cf, &tag, 0, bits);
+      for (auto &v : cf)
+      {
+        expect((uint64_t)v < (1ULL << bits));
+        if ((uint64_t)v > p / 2)
+          v -= (int64_t)p;
+      }
+      unpack_compact_int_arr(cf.data(), back.data(), back.size(), bits, p);
+      expect(back == tag);
+    }
+  };
+
+  "Plan"_test = []
+  {
+    // Synthetic costs linear in the ring dimension and the modulus size; ring
+    // 8192 cannot be instantiated, nor can depth > 1 at ring 16384
+    auto costs = [](size_t ring_dim, uint64_t plain_mod, size_t depth) -> optional<OpCosts>
+    {
+      if (ring_dim == 8192 || (ring_dim == 16384 && depth > 1))
+        return nullopt;
+      double t = (double)ring_dim * (double)(depth + plain_mod_bits(plain_mod) / 16) * 1e-9;
+      OpCosts op = {t, t, t, t, 2 * t, t, t, 0, 0, ring_dim * 64};
+      return op;
+    };
+    PlanRequest req = {4, 1 << 12, 1 << 12, 1 << 24, 4, 40, 0, false, false};
+    PlanSpace space;
+    vector<PlanConfig> configs = plan_configs(req, space, costs);
+    expect(!configs.empty());
+    for (size_t i = 0; i < configs.size(); i++)
+    {
+      const PlanConfig &c = configs[i];
+      expect(c.ring_dim != 8192);
+      expect(c.ring_dim != 16384 || c.depth == 1);
+      expect(c.n_ct * c.batch_size >= c.map_sz);
+      expect(c.plain_mod % (2 * c.ring_dim) == 1);
+      if (i > 0)
+        expect(configs[i - 1].est_s <= c.est_s);
+    }
+    // Cuckoo hashing shrinks the map from 2^24 to a few thousand slots
+    expect(configs[0].num_hash_fns > 1);
+    expect(configs[0].pack_type == MULTIPLE_COMPACT);
+
+    // A sparse map of 2^12 elements needs at most 2^12 ciphertexts
+    req.sparse = true;
+    space.hash_fns = {1};
+    for (auto &c : plan_configs(req, space, costs))
+      expect(c.n_ct <= req.x0 && c.n_ct <= (c.map_sz + c.batch_size - 1) / c.batch_size);
+    req.sparse = false;
+
+    // A fixed choice is respected
+    space.hash_fns = {1};
+    space.ring_dims = {32768};
+    configs = plan_configs(req, space, costs);
+    for (auto &c : configs)
+      expect(c.num_hash_fns == 1 && c.ring_dim == 32768 && c.map_sz == (size_t)(1 << 24));
+  };
+
+  "SetFile"_test = []
+  {
+    vector<string> X = random_strings(1024);
+    X[7] = "short";
+    vector<int64_t> ad(X.size());
+    random_ints(ad, 65537);
+
+    string path = temp_path("setfile_test");
+    SetFile::pack(X, ad).write(path);
+    SetFile f = SetFile::open(path);
+    expect(f.view.size() == X.size());
+    expect(f.view.ad != nullptr);
+    for (size_t i = 0; i < X.size(); i++)
+    {
+      expect(f.view[i] == X[i]);
+      expect(f.view.ad[i] == ad[i]);
+    }
+
+    // Hashing the mapped view fills the same slots as hashing the strings
+    ProtocolParameters pro_parms = {0, 2, 4096, 48, 4, 1, false, MULTIPLE_COMPACT, nullptr, nullptr};
+    HashMap hm_str(pro_parms), hm_view(pro_parms);
+    hm_str.insert(X);
+    hm_view.insert(f.view);
+    expect(hm_str.data.n_used() == hm_view.data.n_used());
+    for (size_t j = 0; j < hm_str.n; j++)
+    {
+      expect(hm_str.data.is_used(j) == hm_view.data.is_used(j));
+      if (hm_str.data.is_used(j))
+        expect(memcmp(hm_str.data.slot(j), hm_view.data.slot(j), hm_str.sz) == 0);
+    }
+    remove(path.c_str());
+  };
+
+  "Chunks"_test = []
+  {
+    shared_ptr<CCParams<CryptoContextBFVRNS>> bfv_parms = gen_bfv_params(32768);
+    CryptoContext<DCRTPoly> bfv_ctx = gen_crypto_ctx(bfv_parms);
+    size_t batch_size = 1365, n_cf_per_hash = 32768 / batch_size, map_sz = (batch_size * 5) + 100;
+    ProtocolParameters pro_parms = {0, 2, map_sz, 48, 4, batch_size, false, MULTIPLE_COMPACT, nullptr, nullptr};
+    HashMap hm(pro_parms);
+    hm.insert(random_strings(map_sz / 2));
+    hm.fill_empty_zeros();
+
+    // Plaintexts built a chunk at a time match the ones built all at once,
+    // up to the random filler after the last hash
+    vector<PT> full, one_hot, zero_hot, part, part_one, part_zero;
+    hm.serialize_data(bfv_ctx, full, false, batch_size);
+    hm.hot_encoding_mask(bfv_ctx, one_hot, zero_hot, batch_size);
+    expect(full.size() == hm.n_plaintexts(batch_size));
+    for (size_t begin = 0; begin < full.size(); begin += 2)
+    {
+      size_t end = min(begin + 2, full.size());
+      hm.serialize_range(bfv_ctx, part, false, batch_size, begin, end);
+      hm.hot_encoding_range(bfv_ctx, part_one, part_zero, batch_size, true, begin, end);
+      expect(part.size() == end - begin);
+      for (size_t i = begin; i < end; i++)
+      {
+        size_t count = (i == full.size() - 1) ? (map_sz % batch_size) : batch_size;
+        const vector<int64_t> &a = full[i]->GetPackedValue(), &b = part[i - begin]->GetPackedValue();
+        expect(equal(a.begin(), a.begin() + (count * n_cf_per_hash), b.begin()));
+        expect(one_hot[i]->GetPackedValue() == part_one[i - begin]->GetPackedValue());
+        expect(zero_hot[i]->GetPackedValue() == part_zero[i - begin]->GetPackedValue());
+      }
+    }
+  };
+
+  "SumTree"_test = [ctx]
+  {
+    Party party;
+    party.ckks_ctx = ctx;
+    party.pro_parms.pool = make_shared<BS::thread_pool>(4);
+    KeyPair<DCRTPoly> kp = ctx->KeyGen();
+
+    // An odd count, so some tree levels have an unpaired part
+    vector<CT> parts;
+    for (size_t i = 1; i <= 7; i++)
+      parts.push_back(ctx->Encrypt(kp.publicKey, ctx->MakeCKKSPackedPlaintext(vector<double>{(double)i})));
+    PT pt;
+    ctx->Decrypt(kp.secretKey, party.sum_tree(parts), &pt);
+    pt->SetLength(1);
+    expect(round(pt->GetCKKSPackedValue()[0].real()) == 28.0);
+  };
+
+  "CtStore"_test = [ctx]
+  {
+    BS::thread_pool pool(4);
+    KeyPair<DCRTPoly> kp = ctx->KeyGen();
+    size_t count = 10;
+    string prefix = temp_path("ctstore_test");
+    CtStore store(prefix, count, 4), perm(prefix + ".perm", count, 4);
+    vector<CT> seg;
+    for (size_t k = 0; k < store.n_segments(); k++)
+    {
+      seg.clear();
+      for (size_t i = store.seg_begin(k); i < store.seg_begin(k) + store.seg_size(k); i++)
+        seg.push_back(ctx->Encrypt(kp.publicKey, ctx->MakeCKKSPackedPlaintext(vector<double>{(double)i})));
+      store.write_segment(k, seg, pool);
+    }
+
+    // Shuffled segments hold the ciphertexts idx points at
+    vector<size_t> idx(count);
+    for (size_t i = 0; i < count; i++)
+      idx[i] = count - 1 - i;
+    store.permute(idx, perm);
+    for (size_t k = 0; k < perm.n_segments(); k++)
+    {
+      perm.read_segment(k, seg, pool);
+      expect(seg.size() == perm.seg_size(k));
+      for (size_t i = 0; i < seg.size(); i++)
+      {
+        PT pt;
+        ctx->Decrypt(kp.secretKey, seg[i], &pt);
+        pt->SetLength(1);
+        expect(round(pt->GetCKKSPackedValue()[0].real()) == (double)idx[perm.seg_begin(k) + i]);
+      }
+    }
+    store.remove_all();
+    perm.remove_all();
+    remove(prefix.c_str());
+  };
+
+  "Trace"_test = []
+  {
+    BS::thread_pool pool(4);
+    Tracer::enable();
+    {
+      TraceSpan outer("outer", 3);
+      parallel_for("inner", pool, 64, [](const size_t start, const size_t end)
+                   { expect(Tracer::party() == 3); });
+    }
+    expect(Tracer::party() == 0);
+
+    // Every pool block is an "inner" span of party 3, nested in "outer"
+    vector<TraceEvent> events = Tracer::collect();
+    size_t n_inner = 0;
+    for (auto &e : events)
+    {
+      expect(e.party == 3);
+      expect(e.t0 <= e.t1);
+      n_inner += (string(e.name) == "inner");
+    }
+    expect(n_inner == pool.get_thread_count());
+
+    string path = temp_path("trace_test");
+    Tracer::write(path);
+    ifstream sum_in(path + ".summary.json");
+    string summary((istreambuf_iterator<char>(sum_in)), istreambuf_iterator<char>());
+    expect(summary.find("\"name\":\"inner\",\"count\":4") != string::npos);
+    Tracer::enabled = false;
+    remove(path.c_str());
+    remove((path + ".summary.json").c_str());
+  };
+
   return 0;
 }
 
@@ -276,8 +786,8 @@ int old_main()
     ctx->Decrypt(kp.secretKey, ct2, &pt4);
 
     vector<vector<uint8_t>> unp1, unp2;
-    unpack_multiple_compact(pt3, &unp1, sizeof(int64_t));
-    unpack_multiple_compact(pt4, &unp2, sizeof(int64_t));
+    unpack_multiple_compact(pt3, &unp1, sizeof(int64_t), 4);
+    unpack_multiple_compact(pt4, &unp2, sizeof(int64_t), 4);
 
     int64_t x3 = *(int64_t *)unp1[0].data(), x4 = *(int64_t *)unp2[0].data();
 
@@ -293,8 +803,8 @@ int old_main()
     ctx->Decrypt(kp.secretKey, res.sum, &pt_sum);
     ctx->Decrypt(kp.secretKey, res.carry, &pt_carry);
     vector<vector<uint8_t>> unp3, unp4;
-    unpack_multiple_compact(pt_sum, &unp3, sizeof(int64_t));
-    unpack_multiple_compact(pt_carry, &unp4, sizeof(int64_t));
+    unpack_multiple_compact(pt_sum, &unp3, sizeof(int64_t), 4);
+    unpack_multiple_compact(pt_carry, &unp4, sizeof(int64_t), 4);
     int64_t x_sum = *(int64_t *)unp3[0].data(), x_carry = *(int64_t *)unp4[0].data();
 
     cout << "sum = " << x_sum << endl